@@ -0,0 +1,11 @@
+;; Throughput of 2-argument arithmetic and comparisons
+;; Run with: ./main bench/arith.clj (or ./main --vm bench/arith.clj)
+
+(load "lib.clj")
+
+(fun {arith-loop n acc}
+     {if (<= n 0)
+      {acc}
+      {arith-loop (- n 1) (+ acc (* (/ n 2) (- n 1)))}})
+
+(print (arith-loop 1000000 0))
@@ -0,0 +1,11 @@
+;; Throughput of floating point arithmetic mixed with integers
+;; Run with: ./main bench/float.clj (or ./main --vm bench/float.clj)
+
+(load "lib.clj")
+
+(fun {basel-loop n acc}
+     {if (<= n 0)
+      {acc}
+      {basel-loop (- n 1) (+ acc (/ 1.0 (* n n)))}})
+
+(print (basel-loop 1000000 0.0))
@@ -0,0 +1,17 @@
+#!/bin/sh
+# Generate a large source file to benchmark the reader
+# Usage: bench/gen_source.sh [megabytes] > big.clj
+# Then: time ./main big.clj
+# Each line is a quoted list, which evaluates to itself, so loading the
+# file mostly measures reading it
+
+MB=${1:-50}
+awk -v mb="$MB" 'BEGIN {
+    target = mb * 1024 * 1024
+    size = 0
+    for (i = 0; size < target; i++) {
+        line = sprintf("{def-%d (\\ {x y} {+ x (* y %d)}) \"str %d\\n\" %d.5 -%d {nested {list %d}}} ; comment %d", i, i, i, i, i, i, i)
+        print line
+        size += length(line) + 1
+    }
+}'
@@ -0,0 +1,15 @@
+;; Higher-order functions (map, filter, foldl) over a large list
+;; Run with: ./main bench/hof.clj
+
+(load "lib.clj")
+
+(fun {range-acc n acc}
+     {if (== n 0)
+      {acc}
+      {range-acc (- n 1) (join (list n) acc)}})
+(fun {range n} {range-acc n nil})
+
+(def {xs} (range 10000))
+(print (len (map (\ {x} {* x 2}) xs)))
+(print (len (filter (\ {x} {> x 5000}) xs)))
+(print (foldl + 0 xs))
@@ -0,0 +1,17 @@
+;; List-heavy workload: builds and transforms lists of numbers
+;; Run with: ./main bench/lists.clj
+
+(load "lib.clj")
+
+;; Build {1 2 ... n} without recursion depth proportional to n
+(fun {range-acc n acc}
+     {if (== n 0)
+      {acc}
+      {range-acc (- n 1) (join (list n) acc)}})
+(fun {range n} {range-acc n nil})
+
+(def {xs} (range 1000))
+(def {pairs} (map (\ {x} {list x x}) xs))
+(def {evens} (filter (\ {x} {== 0 (- x (* 2 (/ x 2)))}) xs))
+
+(print (len xs) (len pairs) (len evens) (sum evens))
@@ -0,0 +1,37 @@
+;; Keyed lookup: finding every key of a table stored as a list of
+;; {key value} pairs (a scan per lookup) and as a hash map (get)
+;; Run with: ./main bench/maps.clj
+
+(load "lib.clj")
+
+(def {n} 1000)
+
+(fun {pairs-acc i acc}
+     {if (== i 0)
+      {acc}
+      {pairs-acc (- i 1) (join (list (list (to-string i) i)) acc)}})
+(def {table} (pairs-acc n nil))
+
+(fun {fill-map lst m}
+     {if (== lst nil)
+      {m}
+      {fill-map (tail lst) (assoc m (first (first lst)) (second (first lst)))}})
+(def {m} (fill-map table #{}))
+
+(fun {lookup k lst}
+     {if (== (first (first lst)) k)
+      {second (first lst)}
+      {lookup k (tail lst)}})
+
+(fun {sum-lookup i acc}
+     {if (> i n)
+      {acc}
+      {sum-lookup (+ i 1) (+ acc (lookup (to-string i) table))}})
+
+(fun {sum-get i acc}
+     {if (> i n)
+      {acc}
+      {sum-get (+ i 1) (+ acc (get m (to-string i)))}})
+
+(print (sum-lookup 1 0))
+(print (sum-get 1 0))
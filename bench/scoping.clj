@@ -0,0 +1,33 @@
+;; Globals that share a name with the arguments of a function using
+;; select, case, let or if: the cases and bodies are evaluated inside the
+;; lib.clj functions, and must still see the arguments, not the globals
+;; Run with: ./main bench/scoping.clj and ./main --vm bench/scoping.clj
+;; Expected output: 55, "five", 5, "six", 5, 6765, then 6
+
+(load "lib.clj")
+
+(def {n} 1)
+(print (fib 10))
+
+(def {x} 100)
+(fun {sel x} {select {(== x 5) "five"} {otherwise "other"}})
+(print (sel 5))
+
+(fun {let-arg x} {let {do x}})
+(print (let-arg 5))
+
+(fun {case-arg x} {case x {5 "five"} {6 "six"}})
+(print (case-arg 6))
+
+(fun {if-arg x} {if (== x 5) {x} {0}})
+(print (if-arg 5))
+
+;; Deep recursion through select while 'n' is also a global
+(print (fib 20))
+
+;; A function body resolves its own free symbols lexically: the global
+;; 'x', not the argument of its caller
+(def {x} 5)
+(fun {addx y} {+ x y})
+(fun {g x} {addx 1})
+(print (g 1000))
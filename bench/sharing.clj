@@ -0,0 +1,25 @@
+;; Persistent lists and maps: walking and rebuilding lists with the
+;; recursive functions of lib.clj (tail and join on every step), and
+;; adding keys to a map whose older version is still bound
+;; Run with: ./main bench/sharing.clj
+
+(load "lib.clj")
+
+(def {n} 20000)
+
+(fun {range-acc n acc}
+     {if (== n 0)
+      {acc}
+      {range-acc (- n 1) (join (list n) acc)}})
+(def {xs} (range-acc n nil))
+
+(print (len xs) (sum xs) (len (map (\ {x} {* x x}) xs)) (len (filter (\ {x} {> x 100}) xs)))
+
+;; Each version stays bound in the global environment while the next one
+;; is made from it
+(def {m} #{})
+(fun {fill i}
+     {if (> i n)
+      {len (keys m)}
+      {do (def {m} (assoc m i (* i i))) (fill (+ i 1))}})
+(print (fill 1) (get m 100))
@@ -0,0 +1,18 @@
+;; List functions that used to be defined in lib.clj (now builtins) on a
+;; list of n numbers
+;; Run with: ./main bench/stdlib.clj
+
+(load "lib.clj")
+
+(def {n} 100000)
+
+(fun {range-acc i acc}
+     {if (== i 0)
+      {acc}
+      {range-acc (- i 1) (join (list i) acc)}})
+(def {xs} (range-acc n nil))
+
+(print (len xs) (nth (- n 1) xs) (last xs) (elem n xs))
+(print (len (take (/ n 2) xs)) (len (drop (/ n 2) xs)))
+(print (len (map (\ {x} {* x 2}) xs)) (len (filter (\ {x} {> x (/ n 2)}) xs)))
+(print (foldl + 0 xs))
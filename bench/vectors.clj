@@ -0,0 +1,28 @@
+;; Indexed access: summing by index over a list (nth walks from the head)
+;; and over a vector (vget is one array access)
+;; Run with: ./main bench/vectors.clj
+
+(load "lib.clj")
+
+(fun {range-acc n acc}
+     {if (== n 0)
+      {acc}
+      {range-acc (- n 1) (join (list n) acc)}})
+(fun {range n} {range-acc n nil})
+
+(def {n} 1000)
+(def {xs} (range n))
+(def {v} (vec xs))
+
+(fun {sum-nth lst i acc}
+     {if (== i n)
+      {acc}
+      {sum-nth lst (+ i 1) (+ acc (nth i lst))}})
+
+(fun {sum-vget v i acc}
+     {if (== i n)
+      {acc}
+      {sum-vget v (+ i 1) (+ acc (vget v i))}})
+
+(print (sum-nth xs 0 0))
+(print (sum-vget v 0 0))
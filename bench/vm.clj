@@ -0,0 +1,21 @@
+;; Tree-walking evaluator vs bytecode VM
+;; Run with: ./main bench/vm.clj and ./main --vm bench/vm.clj
+
+(load "lib.clj")
+
+(fun {range-acc n acc}
+     {if (== n 0)
+      {acc}
+      {range-acc (- n 1) (join (list n) acc)}})
+(fun {range n} {range-acc n nil})
+
+(fun {fib2 n}
+     {if (< n 2)
+      {n}
+      {+ (fib2 (- n 1)) (fib2 (- n 2))}})
+
+(print (fib2 22))
+
+(def {xs} (range 5000))
+(print (foldl + 0 (map (\ {x} {* x 2}) xs)))
+(print (foldl (\ {acc x} {+ acc (* x x)}) 0 xs))
@@ -1 +1 @@
-cc -std=c99 -g -Wall main.c mpc.c -ledit -o main
\ No newline at end of file
+cc -std=c11 -g -Wall main.c mpc.c -ledit -o main
\ No newline at end of file
@@ -15,7 +15,7 @@
 
 ;; Unpack list for function
 (fun {unpack f args}
-     {eval (join (list f)) args})
+     {eval (join (list f) args)})
 
 ;; Pack list for function
 (fun {pack f & args}
@@ -26,16 +26,16 @@
 (def {uncurry} pack)
 
 ;; Perform things in sequence
-;; Note: the list items are evaluated then the last one is returned
-(fun {do & lst}
-     {if (== lst nil)
-      {nil}
-      {last lst}})
+;; do is a builtin: the arguments are evaluated in order and the last one is
+;; returned, evaluated in tail position (a recursive call there does not
+;; nest). (do (print 1) 2) -> 2
 
 ;; Open new scope
-;; Creates an empty function for code to take place in, and evaluates it.
+;; Evaluates the code in the frame of this call, where '=' binds locally.
+;; Going through eval lets the code see the arguments of the caller before
+;; the globals.
 (fun {let body}
-     {((\ {_} body) ())})
+     {eval body})
 ;; lispy> let {do (= {x} 100) (x)}
 ;; 100
 ;; lispy> x
@@ -65,71 +65,21 @@
 (fun {second lst} {eval (head (tail lst))})
 (fun {third lst} {eval (head (tail (tail lst)))})
 
-;; Find list length
-(fun {len lst}
-     {if (== lst nil)
-      {0}
-      {+ 1 (len (tail lst))}})
-
-;; Nth item in list
-(fun {nth n lst}
-     {if (== n 0)
-      {first lst}
-      {nth (- n 1) (tail lst)}})
-
-;; Last item in list
-(fun {last lst}
-     {nth (- (len lst) 1) lst})
-
-;; Take n items from a list
-(fun {take n lst}
-     {if (== n 0)
-      {nil}
-      {join (head lst) (take (- n 1) (tail lst))}})
-
-;; Drop n items from a list
-(fun {drop n lst}
-     {if (== n 0)
-      {lst}
-      {drop (- n 1) (tail lst)}})
+;; len, nth, last, take, drop, elem, map, filter and foldl are builtins.
+;; Defining them again (with fun) replaces the builtin, like any other name.
+;; (len {1 2 3}) -> 3, (nth 1 {a b c}) -> b, (last {1 2}) -> 2
+;; (take 2 {1 2 3}) -> {1 2}, (drop 2 {1 2 3}) -> {3}, (elem 2 {1 2}) -> 1
+;; (map (\ {x} {* x 2}) {1 2}) -> {2 4}
+;; (filter (\ {x} {> x 1}) {1 2 3}) -> {2 3}
+;; (foldl + 0 {1 2 3}) -> 6
 
 ;; Split into 2 lists at n
 (fun {split n lst}
      {list (take n lst) (drop n lst)})
 
-;; Check if an element is in list
-(fun {elem x lst}
-     {if (== lst nil)
-      {false}
-      {if (== x (first lst))
-       {true}
-       {elem x (tail lst)}}})
-
-;; Apply a function to every element in list
-(fun {map f lst}
-     {if (== lst nil)
-      {nil}
-      {join (list (f (first lst)) (map f (tail lst)))}})
-
-;; Apply filter on a list
-(fun {filter f lst}
-     {if (== lst nil)
-      {nil}
-      {join 
-       (if (f (first lst))
-         {head lst}
-         {nil}) 
-       (filter f (tail lst))}})
-
-;; Fold left (reduce)
-(fun {foldl f base lst}
-     {if (= lst nil)
-      {base}
-      {foldl f (f base (first lst)) (tail lst)}})
-
 ;; Sum and product of elements in list
 (fun {sum lst} {foldl + 0 lst})
-(fun {product lst} {foldl * 0 lst})
+(fun {product lst} {foldl * 1 lst})
 
 ;; Conditional - select
 (def {otherwise} true) ;; like default
@@ -1,5 +1,18 @@
+// mmap and friends (see lfile_open)
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <editline/readline.h>
 #include <editline/history.h>
@@ -25,6 +38,16 @@
             "Function '%s' received incorrect type for argument %i. Expected %s. Got %s.", \
             func_name, index, ltype_name(expected_type), ltype_name(args->cell[index]->type));
 
+#define LASSERT_ARG_NUMBER(func_name, args, index)                                         \
+    LASSERT(args, lval_is_number(args->cell[index]),                                       \
+            "Function '%s' received incorrect type for argument %i. Expected %s. Got %s.", \
+            func_name, index, ltype_name(LVAL_NUM), ltype_name(args->cell[index]->type));
+
+#define LASSERT_INDEX(func_name, args, index, min, max)                                            \
+    LASSERT(args, args->cell[index]->num >= (min) && args->cell[index]->num <= (max),              \
+            "Function '%s' received index %li out of range for argument %i. Expected %li to %li.", \
+            func_name, args->cell[index]->num, index, (long)(min), (long)(max));
+
 #define LASSERT_NOT_EMPTY(func_name, args, index) \
     LASSERT(args, args->cell[index]->count > 0,   \
             "Function '%s' passed {} for argument %i.", func_name, index);
@@ -32,18 +55,26 @@
 // Forward type declarations
 struct lval;
 struct lenv;
+struct lcode;
+struct lcells;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+typedef struct lcells lcells;
 
 // Lisp value types
 enum
 {
     LVAL_ERR,   // error
     LVAL_NUM,   // number
+    LVAL_BIG,   // number too large for a long (bignum)
+    LVAL_DBL,   // floating point number
     LVAL_SYM,   // symbol
     LVAL_STR,   // string
     LVAL_SEXPR, // S-expression
     LVAL_QEXPR, // Q-expression
+    LVAL_VEC,   // vector
+    LVAL_MAP,   // hash map
     LVAL_FUN    // function
 };
 
@@ -51,93 +82,612 @@ enum
 typedef lval *(*lbuiltin)(lenv *, lval *);
 
 // List value
+// Only the fields of the active type are stored (the union overlaps them),
+// so a value costs the size of its largest variant instead of all of them
+// Values are reference counted and shared. A value must only be modified
+// while it has a single reference (see lval_unshare), and the elements of
+// a list only while its cell buffer is its own (see lval_own).
 struct lval
 {
     int type;
+    int refs; // number of references
 
-    // Basic
-    long num;
-    char *err;
-    char *sym;
-    char *str;
+    union
+    {
+        // Basic
+        long num;
+        double dbl;
+        char *err;
+        char *sym;
+        char *str;
+
+        // Bignum
+        // Magnitude in base 2^32, least significant limb first. A bignum
+        // never holds a value that fits in a long (see lval_big_norm).
+        struct
+        {
+            int neg;
+            int nlimbs;
+            uint32_t *limbs;
+        };
 
-    // Function
-    lbuiltin builtin; // NULL -> user-defined function
-    lenv *env;
-    lval *formals; // formal arguments (parameters)
-    lval *body;
+        // Function
+        struct
+        {
+            lbuiltin builtin; // NULL -> user-defined function
+            lenv *env;
+            lval *formals; // formal arguments (parameters)
+            lval *body;
+            lcode *code; // compiled body (--vm), NULL until the first call
+        };
+
+        // Hash map (and the nodes below it)
+        // A hash array mapped trie: each level takes 5 bits of the hash of
+        // the keys. 'slots' holds the key and value of each bit set in
+        // 'datamap', then the node of each bit set in 'nodemap', all in the
+        // order of the bits. Keys whose hashes are all the same end up in a
+        // collision node below the last level, with both maps 0 and
+        // 'nentries' keys and values. 'nentries' counts the entries of the
+        // whole subtree. Nodes are never changed once shared, so versions
+        // of a map share what they have in common.
+        struct
+        {
+            int nentries;
+            uint32_t datamap;
+            uint32_t nodemap;
+            lval **slots;
+        };
+
+        // Expression (and vector)
+        // A view of 'count' elements starting at 'cell' in the cell buffer
+        // 'buf' (NULL while the list has none), see lcells
+        struct
+        {
+            int count;
+            lval **cell;
+            lcells *buf;
+        };
+    };
+};
 
-    // Expression
-    int count;
-    lval **cell;
+// Cell buffer
+// The elements of lists live in reference counted buffers, and a list is
+// a view of some of them: copies, tails and slices share the buffer
+// instead of copying the elements. The buffer holds a reference to the
+// element of each slot in [lo, hi). The slots outside are free, so a list
+// ending at hi (or starting at lo) can grow into them in place while other
+// lists share the buffer, since none of them can see those slots.
+struct lcells
+{
+    int refs;     // number of lists using the buffer
+    int capacity; // number of slots
+    int lo;       // first slot holding an element
+    int hi;       // slot after the last one holding an element
+    lval *slots[];
 };
 
 // Environment (map sym -> lval)
+// Bindings are stored in insertion order. Once an environment grows past
+// LENV_SCAN_MAX bindings, an open-addressing hash index keyed by the
+// interned symbol pointer maps symbols to their position.
+// Environments are reference counted: lambdas keep the environment they
+// were created in, and call frames keep the environment of the lambda.
+#define LENV_SCAN_MAX 8
+#define LENV_PRUNE_MAX 16 // caller frames checked by lenv_prune
 struct lenv
 {
-    lenv *parent; // reference to parent environment
+    int refs;     // number of references
+    lenv *parent; // lexical parent (the environment the lambda was created in)
+    lenv *caller; // environment of the caller while a call frame is active
+    int evals;    // evaluations by 'eval' running in it (see lenv_get)
 
     int count;
-    char **syms;
+    int capacity;
+    char **syms; // interned symbols
     lval **vals;
+
+    int index_size; // number of index slots (power of 2, 0 while unindexed)
+    int *index;     // position in syms/vals, -1 for an empty slot
+
+    lenv *gc_prev; // list of all environments (see lgc)
+    lenv *gc_next;
+    int gc_refs; // scratch for the cycle collector
+};
+
+// Bumped when a symbol is added to an environment that is the lexical
+// parent of something, which invalidates the positions cached by compiled
+// code (see LOP_LOOKUP)
+int lenv_epoch = 1;
+
+// Arithmetic operators (see builtin_op)
+enum
+{
+    LMATH_ADD,
+    LMATH_SUB,
+    LMATH_MUL,
+    LMATH_DIV
+};
+char *lmath_names[] = {"+", "-", "*", "/"};
+
+// Comparison operators (see builtin_order, builtin_cmp)
+enum
+{
+    LCMP_GT,
+    LCMP_GE,
+    LCMP_LT,
+    LCMP_LE,
+    LCMP_EQ,
+    LCMP_NE
+};
+char *lcmp_names[] = {">", ">=", "<", "<=", "==", "!="};
+
+// Bytecode instructions
+// Operands follow the opcode in the instruction stream. The cache of
+// LOP_LOOKUP is 3 words (epoch, depth, slot): where the symbol was found
+// in the lexical chain, valid while lenv_epoch is unchanged.
+enum
+{
+    LOP_CONST,  // const         push a constant
+    LOP_LOCAL,  // slot, const   push an argument from the call frame
+    LOP_LOOKUP, // const, cache  push the value bound to a symbol
+    LOP_CALL,   // n             call the function below n - 1 arguments
+    LOP_TAIL,   // n             call in tail position (reuses the VM loop)
+    LOP_IF,     // target        pop 'if' if it is the builtin, else jump
+    LOP_DO,     // target        pop 'do' if it is the builtin, else jump
+    LOP_POP,    //               drop the value on top of the stack
+    LOP_BRANCH, // target, const pop the condition, jump if it is false
+    LOP_JUMP,   // target        continue at target
+    LOP_RETURN  //               return the value on top of the stack
+};
+
+// Compiled code of a function body or a top-level expression
+struct lcode
+{
+    int refs; // number of references
+
+    int count;
+    int capacity;
+    int *ops; // instructions and their operands
+
+    int const_count;
+    int const_capacity;
+    lval **consts; // constants (literals, symbols, branches)
+
+    int depth;      // stack depth while compiling
+    int max_depth;  // stack slots needed to run
+    int frame_size; // bindings in a new frame of the function (-1 if not a function body)
+};
+
+int lvm_enabled = 0; // compile functions to bytecode (--vm)
+
+// Calls fail once the C stack is nearly used up, instead of crashing. The
+// reserve is left to the builtins and printing below the deepest call.
+#define LSTACK_RESERVE (256 * 1024)
+
+uintptr_t lstack_base = 0; // address near the top of the C stack (see main)
+size_t lstack_limit = 0;   // bytes calls may use, 0 if unlimited
+
+// Symbol table - every symbol name is stored once, so symbols can be
+// compared by pointer
+typedef struct lsymtab
+{
+    int count;
+    int size;     // number of slots (power of 2)
+    char **slots; // NULL for an empty slot
+} lsymtab;
+
+lsymtab symtab;
+
+// Memory pools
+// Compile with -DLISPY_USE_MALLOC to send every allocation straight to
+// malloc/free instead (for ASan/valgrind runs)
+#define LPOOL_SLAB_SIZE (64 * 1024) // bytes carved into objects at a time
+#define LCELL_CLASSES 6             // pooled cell buffers: 1, 2, 4, ..., 32 slots
+#define LCELL_POOLED_MAX (1 << (LCELL_CLASSES - 1))
+
+// Pool of fixed-size objects
+typedef struct lpool
+{
+    size_t size;    // object size in bytes
+    void *free;     // free list, the next pointer is stored in the free object
+    char **slabs;   // slabs allocated so far
+    int slab_count;
+    long live; // objects currently handed out
+} lpool;
+
+// Allocator state of the interpreter
+typedef struct lheap
+{
+    lpool lvals;
+    lpool lenvs;
+    lpool cells[LCELL_CLASSES]; // size classes for cell buffers
+} lheap;
+
+lheap heap;
+
+// Cycle collector
+// Reference counting frees everything except cycles, and every cycle goes
+// through an environment (e.g. a lambda bound in the environment it closes
+// over), so all environments are tracked. Values alone cannot form one: a
+// list or map is never added in place to a cell buffer other lists see,
+// where it could be a view of that buffer (see lcells_can_take).
+// A collection subtracts the references coming from inside the graph of
+// environments (and the values reachable from them): what still has
+// references left is held from the outside (main, the evaluator, builtins
+// running) and stays alive with everything it reaches. The other
+// environments are only kept alive by cycles and are freed by clearing
+// their bindings.
+// Cell buffers shared by several lists are nodes of their own, since each
+// list only sees part of the references the buffer holds.
+#define LGC_THRESHOLD_MIN 10000 // environments allocated between collections
+#define LGC_LIVE -1             // scratch count of a node held from outside
+
+// Kinds of nodes (tagged in the low bits of their address)
+enum
+{
+    LGC_VALUE,
+    LGC_ENV,
+    LGC_CELLS
+};
+
+typedef struct lgc
+{
+    lenv *envs; // all environments
+    int env_count;
+    long allocated; // environments allocated since the last collection
+    long threshold; // allocations before the next collection
+
+    // Values and cell buffers reachable from environments while collecting
+    // (open addressing, tagged node -> scratch count)
+    int size;
+    int count;
+    uintptr_t *keys;
+    int *counts;
+
+    // Nodes to scan (tagged with their kind)
+    int work_count;
+    int work_capacity;
+    uintptr_t *work;
+    long scanned; // references scanned by this collection
+
+    // Statistics
+    long collections;
+    long reclaimed;   // environments freed
+    long pause_total; // microseconds
+    long pause_max;
+} lgc;
+
+lgc gc = {.threshold = LGC_THRESHOLD_MIN};
+
+// Reader
+                                // Turns source text straight into Lisp values in a single pass, with the
+                                // grammar mpc used to parse:
+                                //   number  : /-?[0-9]+(\.[0-9]+)?([eE][-+]?[0-9]+)?/
+                                //   symbol  : /[a-zA-Z0-9_+\-*\/\\=<>!&]+/
+                                //   string  : /"(\\.|[^"])*"/
+                                //   comment : /;[^\r\n]*/
+                                //   sexpr   : '(' <expr>* ')'
+                                //   qexpr   : '{' <expr>* '}'
+                                //   vector  : '[' <expr>* ']'
+                                //   map     : '#{' (<expr> <expr>)* '}'
+                                // Whitespace separates tokens, and a number is tried before a symbol
+                                // A reader either has the whole input in memory, or reads it from a file
+                                // descriptor as needed, one top-level expression at a time (see
+                                // lreader_next), so pipes are evaluated while they are written
+#define LREADER_CHUNK 65536     // bytes read at a time from a file descriptor
+#define LREADER_DEPTH_MAX 10000 // nesting of lists and maps read
+enum
+{
+    LSCAN_CODE,
+    LSCAN_STRING,
+    LSCAN_COMMENT
+};
+typedef struct lreader
+{
+    char *filename;             // for error messages
+    char *start;                // always at the start of a line
+    char *pos;                  // next character
+    char *end;
+    int row;                    // lines before start
+
+    // Input read from a file descriptor (-1 when it is all in memory)
+    int fd;
+    long capacity; // size of the buffer starting at start
+    int error;     // errno of a failed read (0 if none)
+
+    // Where lreader_complete stopped: offset from pos, bracket depth and
+    // what it was in (LSCAN_*)
+    long scan;
+    int scan_depth;
+    int scan_mode;
+
+    int depth; // lists and maps being read
+
+    // Scratch space for the text of a token
+    char *buf;
+    long buf_size;
+} lreader;
+
+// Output buffer
+// Printing goes to a buffer that is passed on to its file in one write
+// when it is full or flushed, or is kept whole to make a string (out NULL)
+#define LWRITER_CHUNK 65536 // bytes buffered before they are written to a file
+typedef struct lwriter
+{
+    char *data;
+    long len;
+    long capacity;
+    FILE *out; // NULL to keep everything
+} lwriter;
+
+// Contents of a file loaded with lfile_open
+typedef struct lfile
+{
+    char *data; // mapped contents, NULL for a stream
+    long len;
+    int fd; // open file descriptor of a stream, -1 otherwise
+} lfile;
+
+// Position in the walk over the entries of a map: the nodes on the path
+// to the current entry, and the next slot to look at in each
+#define LMAP_DEPTH 8 // 7 levels of hash bits, then a collision node
+typedef struct lmap_iter
+{
+    lval *nodes[LMAP_DEPTH];
+    int next[LMAP_DEPTH];
+    int depth;
+} lmap_iter;
+
+// Names the builtins were registered under (see lenv_add_builtin), so
+// images can refer to builtins by name instead of by address
+#define LBUILTIN_MAX 64
+typedef struct lbuiltin_entry
+{
+    char *name; // interned symbol
+    lbuiltin func;
+} lbuiltin_entry;
+
+lbuiltin_entry lbuiltins[LBUILTIN_MAX];
+int lbuiltin_count = 0;
+
+// Serialization
+// A value is written as a tag byte (LSER_*) followed by its contents:
+// numbers as varints (zigzag encoded when signed), floats as their 8 bytes
+// (least significant first), text as a length and the bytes, lists as a
+// length and the elements, maps as a length and the keys and values.
+// Environments, and lists, maps and functions with more than one
+// reference (LSER_SHARED), are numbered in the order they are
+// first written, and written again as LSER_REF and their number, so
+// sharing and cycles (a global function refers back to the global
+// environment) survive the round trip. Symbols are numbered separately: 0
+// followed by the name the first time, their number plus one after that.
+// The global environment is not written, but referred to as LSER_GLOBAL,
+// the global environment of the reader.
+// A file starts with a magic string for its kind and LSER_VERSION. An
+// image holds the bindings of the global environment, a serialized file a
+// single value (see builtin_serialize).
+// Values and environments are read recursively, so their nesting is
+// limited: a damaged file can not run the reader out of stack. Values
+// nested deeper are not written either, so what is written can be read.
+#define LSER_VERSION 4
+#define LSER_DEPTH_MAX 10000 // nesting of values and environments read
+#define LIMAGE_MAGIC "LISPYIMG"
+#define LSER_MAGIC "LISPYVAL"
+enum
+{
+    LSER_NUM,
+    LSER_BIG,
+    LSER_DBL,
+    LSER_ERR,
+    LSER_SYM,
+    LSER_STR,
+    LSER_SEXPR,
+    LSER_QEXPR,
+    LSER_VEC,
+    LSER_MAP,     // entries count, (key, value)*
+    LSER_BUILTIN, // symbol the builtin was registered under
+    LSER_LAMBDA,  // environment, formals, body
+    LSER_ENV,     // parent (or LSER_NONE), bindings count, (symbol, value)*
+    LSER_GLOBAL,
+    LSER_NONE,
+    LSER_SHARED, // the list, map or function that follows is numbered
+    LSER_REF     // number of an object written before
 };
+typedef struct lser
+{
+    lenv *root; // global environment
 
-// Parser declarations
-mpc_parser_t *Number;
-mpc_parser_t *Symbol;
-mpc_parser_t *String;
-mpc_parser_t *Comment;
-mpc_parser_t *Sexpr;
-mpc_parser_t *Qexpr;
-mpc_parser_t *Expr;
-mpc_parser_t *Lispy;
+    lwriter out;
+
+    // Input
+    char *pos;
+    char *end;
+    char *error; // first error, the rest of the input is skipped
+    lfile file;  // mapped input
+
+    // Objects by number. Writing: open-addressing table from address
+    // (keys) to number (ids). Reading: object of each number (keys), with
+    // the low bit set for environments, and the next bit for a list that
+    // is still being read.
+    int size;
+    int count;
+    uintptr_t *keys;
+    int *ids;
+    int barrier; // number of the function being read (lists before it may be referred to)
+    int depth;   // nesting of the value or environment being read or written
+
+    // Symbols by number (the writer keeps them in the table of objects)
+    int nsyms;
+    int syms_size;
+    char **syms;
+} lser;
+
+// Memory pools
+void lheap_init();                                               // Set up the pools
+void lheap_cleanup();                                            // Release all slabs
+void *lpool_alloc(lpool *p);                                     // Take an object from a pool
+void lpool_free(lpool *p, void *obj);                            // Return an object to a pool
+lval *lval_alloc();                                              // Allocate an lval with 1 reference
+void lval_free(lval *v);                                         // Release the memory of an lval
+int lcells_capacity(int n);                                      // Slots reserved for n elements
+int lcells_class(int cap);                                       // Pool index for a capacity
+lcells *lcells_alloc(int cap);                                   // Allocate an empty cell buffer
+void lcells_free(lcells *b);                                     // Release the memory of a cell buffer
+void lcells_release(lcells *b);                                  // Drop a reference to a cell buffer
+
+// Cycle collector
+void lgc_track(lenv *e);                                          // Track a new environment
+void lgc_untrack(lenv *e);                                        // Stop tracking a deleted environment
+int lgc_container(lval *v);                                       // Check if a value can hold references
+int *lgc_count(void *node, int kind, int insert);                 // Scratch count of a value or cell buffer
+void lgc_push(void *node, int kind);                              // Add a node to the work list
+void lgc_subtract(void *node, int kind);                          // Remove a reference from inside the graph
+void lgc_mark(void *node, int kind);                              // Mark a node held from outside
+void lgc_visit(void *node, int kind, void (*visit)(void *, int)); // Visit the references of a node
+void lgc_drain(void (*visit)(void *, int));                       // Scan the work list until empty
+void lgc_collect();                                               // Free unreachable cycles
+
+// Symbol table
+unsigned lsym_hash_name(char *name, int len); // Hash a symbol name
+unsigned lsym_hash(char *sym);                // Hash an interned symbol
+char *lsym_intern(char *name);                // Return the unique copy of a symbol name
+char *lsym_intern_len(char *name, int len);   // Same for a name that is not NUL-terminated
+void lsym_cleanup();                          // Free all symbol names
 
 // Construct a new Lisp value
-lval *lval_num(long x);                       // Number
-lval *lval_err(char *fmt_str, ...);           // Error
-lval *lval_sym(char *s);                      // Symbol
-lval *lval_str(char *str);                    // String
-lval *lval_sexpr();                           // S-Expression
-lval *lval_qexpr();                           // Q-Expression
-lval *lval_fun(lbuiltin func);                // Function
-lval *lval_lambda(lval *formals, lval *body); // User-defined function
-
-// Delete a Lisp value
+lval *lval_num(long x);                                  // Number
+lval *lval_big(int neg, int nlimbs);                     // Bignum (zero with room for nlimbs limbs)
+lval *lval_dbl(double x);                                // Floating point number
+lval *lval_err(char *fmt_str, ...);                      // Error
+lval *lval_sym(char *s);                                 // Symbol
+lval *lval_str(char *str);                               // String
+lval *lval_str_len(char *str, long len);                 // String from len characters
+lval *lval_sexpr();                                      // S-Expression
+lval *lval_qexpr();                                      // Q-Expression
+lval *lval_vec();                                        // Vector
+lval *lval_map();                                        // Hash map
+lval *lval_fun(lbuiltin func);                           // Function
+lval *lval_lambda(lenv *env, lval *formals, lval *body); // User-defined function
+
+// Delete a Lisp value (drop a reference)
 void lval_del(lval *v);
 
 // Environment
 lenv *lenv_new();                                          // Create new environment
-void lenv_del(lenv *e);                                    // Delete an environment
+void lenv_del(lenv *e);                                    // Delete an environment (drop a reference)
+lenv *lenv_ref(lenv *e);                                   // Add a reference to an environment
+void lenv_clear(lenv *e);                                  // Remove all bindings
 lval *lenv_get(lenv *e, lval *k);                          // Lookup a value from the environment
 void lenv_def(lenv *e, lval *k, lval *v);                  // Define variable in global environment
 void lenv_put(lenv *e, lval *k, lval *v);                  // Put value into the current environment
+void lenv_bind(lenv *e, char *sym, lval *v);               // Put value under an interned symbol
 void lenv_add_builtins(lenv *e);                           // Register all built-in functions
 void lenv_add_builtin(lenv *e, char *name, lbuiltin func); // Register a built-in function
-lenv *lenv_copy(lenv *e);                                  // Create a copy of an environment
-
-// Construct Lisp value from an AST node
-lval *lval_read_num(mpc_ast_t *t); // Number
-lval *lval_read_str(mpc_ast_t *t); // String
+int lenv_find(lenv *e, char *sym);                         // Position of a symbol in the current environment
+void lenv_reindex(lenv *e, int size);                      // Rebuild the hash index with the given size
+lenv *lenv_locate(lenv *e, char *sym, int *depth);         // Environment binding a symbol lexically
+int lenv_shadowed(lenv *e, lenv *x);                       // Check if lookups from e never reach x
+void lenv_prune(lenv *frame, lenv *base);                  // Release caller frames lookups can no longer reach
+void lenv_unwind(lenv *e, lenv *base);                     // Release the call frames from e up to base
+
+// Bignum arithmetic
+// Operands may be unnormalized bignums, results are not normalized
+lval *lval_big_from(long x);                   // Bignum with the value of a number
+lval *lval_to_big(lval *x);                    // Number or bignum as a bignum
+lval *lval_big_norm(lval *v);                  // Trim a bignum, demote it to a number if it fits
+int lbig_cmp_mag(lval *a, lval *b);            // Compare magnitudes
+lval *lbig_add_mag(lval *a, lval *b, int neg); // Sum of magnitudes
+lval *lbig_sub_mag(lval *a, lval *b, int neg); // Difference of magnitudes (|a| >= |b|)
+lval *lval_big_add(lval *a, lval *b, int sub); // Sum (or difference when sub is set)
+lval *lval_big_mul(lval *a, lval *b);          // Product
+lval *lval_big_div(lval *a, lval *b);          // Quotient truncated toward zero (b != 0)
+int lval_big_cmp(lval *a, lval *b);            // Compare (-1, 0, 1)
+lval *lval_big_read(char *s);                  // Parse a decimal literal
+char *lval_big_str(lval *v);                   // Decimal representation (caller frees)
+
+// Construct Lisp value from source text
+lval *lval_read_num(char *s);      // Number
 lval *lval_add(lval *v, lval *x);  // Add element to S-expression or a Q-expression
-lval *lval_read(mpc_ast_t *t);
+void lval_reserve(lval *v, int n); // Make room for n elements in v
+
+// Reader
+void lreader_init(lreader *r, char *filename, char *src, long len); // Set up a reader over source text
+void lreader_init_fd(lreader *r, char *filename, int fd);           // Set up a reader over a file descriptor
+int lreader_fill(lreader *r);                                       // Read more input from the file descriptor
+int lreader_complete(lreader *r);                                   // Check if a whole expression is buffered
+lval *lreader_next(lreader *r);                                     // Read the next top-level expression
+void lreader_free(lreader *r);                                      // Free the scratch space
+char *lreader_reserve(lreader *r, long n);                          // Make room for n characters of scratch space
+lval *lreader_error(lreader *r, char *expected);                    // Syntax error at the current position
+lval *lreader_fail(lreader *r, char *message);                      // Error with a message at the current position
+int lreader_is_sym(int c);                                          // Check for a symbol character
+int lreader_skip(lreader *r);                                       // Skip whitespace and comments
+lval *lreader_num(lreader *r);                                      // Read a number
+lval *lreader_sym(lreader *r);                                      // Read a symbol
+lval *lreader_str(lreader *r);                                      // Read a string
+lval *lreader_list(lreader *r, lval *x, char close);                // Read the elements of a list
+lval *lreader_map(lreader *r);                                      // Read the keys and values of a map
+lval *lreader_nested(lreader *r, char *expected);                   // Read a list or a map
+lval *lreader_expr(lreader *r, char *expected);                     // Read an expression
+lval *lreader_all(lreader *r);                                      // Read all expressions
 
 // Printing
-void lval_expr_print(lval *v, char open, char close); // Print an S-expression or a Q-expression
-void lval_print_str(lval *v);                         // Print a string
-void lval_print(lval *v);                             // Print a Lisp value
-void lval_println(lval *v);                           // Print a Lisp value followed by a new line
+void lwriter_init(lwriter *w, FILE *out);                          // Set up an output buffer
+void lwriter_free(lwriter *w);                                     // Release an output buffer
+void lwriter_flush(lwriter *w);                                    // Write the buffered output to its file
+char *lwriter_reserve(lwriter *w, long n);                         // Make room for n more characters
+void lwriter_char(lwriter *w, char c);                             // Append a character
+void lwriter_mem(lwriter *w, char *p, long len);                   // Append len characters
+void lwriter_str(lwriter *w, char *str);                           // Append a string
+void lwriter_long(lwriter *w, long x);                             // Append a number in decimal
+void lval_write_expr(lwriter *w, lval *v, char open, char close); // Write the elements of an expression or a vector
+void lval_write_map(lwriter *w, lval *v);                          // Write the keys and values of a map
+void lval_write_str(lwriter *w, lval *v);                          // Write a string literal
+void lval_write_dbl(lwriter *w, lval *v);                          // Write a floating point number
+void lval_write(lwriter *w, lval *v);                              // Write a Lisp value
+void lval_print(lval *v);                                          // Print a Lisp value
+void lval_println(lval *v);                                        // Print a Lisp value followed by a new line
 
 // Evaluation
-lval *lval_call(lenv *e, lval *f, lval *args);   // Function call
-lval *lval_eval_sexpr(lenv *e, lval *v);         // Evaluate an S-expression
-lval *lval_eval(lenv *e, lval *v);               // Evaluate a Lisp value
-lval *builtin_op(lenv *e, lval *args, char *op); // Apply the operation on the argument list
+lval *lval_call(lenv *e, lval *f, lval *args);               // Function call
+int lstack_exhausted();                                      // Check if the C stack is nearly used up
+lenv *lval_bind(lval *f, lval *args, lval **result);         // Bind arguments in a new call frame
+lval *lval_body(lval *f);                                    // Body of a function as an S-expression
+lval *lval_eval(lenv *e, lval *v);                           // Evaluate a Lisp value
+lval *builtin_op(lenv *e, lval *args, int op);               // Apply the operation on the argument list
+lval *lval_num_result(lval *args, long num);                 // Number result of a builtin
+int lval_num_op2(lbuiltin f, long x, long y, long *r);       // Apply a numeric builtin to two numbers
+int lval_dbl_op2(lbuiltin f, double x, double y, double *r); // Apply a numeric builtin to two floats
+lval *lval_op2(lbuiltin f, lval *x, lval *y);                // Apply a numeric builtin to two values
+lval *lval_dbl_fold(lval *args, int op);                     // Apply the operation in floating point
+int lval_is_number(lval *v);                                 // Check for a number, bignum or float
+int lval_is_true(lval *v);                                   // Check if a number is a true condition
+double lval_to_dbl(lval *v);                                 // Value of a number as a float
+
+// Bytecode
+lcode *lcode_new();                                                   // Create an empty code object
+void lcode_del(lcode *c);                                             // Delete a code object (drop a reference)
+int lcode_emit(lcode *c, int word);                                   // Append an instruction word
+int lcode_const(lcode *c, lval *v);                                   // Add a constant
+void lcode_push(lcode *c, int n);                                     // Track the stack depth
+int lcode_slot(lval *formals, char *sym);                             // Frame slot of a formal argument
+void lcode_compile_expr(lcode *c, lval *formals, lval *v, int tail);  // Compile an expression
+void lcode_compile_sexpr(lcode *c, lval *formals, lval *v, int tail); // Compile elements as an S-expression
+lcode *lcode_compile(lval *f);                                        // Compile the body of a function
+lval *lvm_exec(lenv *e, lcode *c);                                    // Run compiled code
+lval *lvm_eval(lenv *e, lval *v);                                     // Compile and run an expression
 
 // Utils
-lval *lval_pop(lval *v, int i);  // Pop the element at index i
-lval *lval_take(lval *v, int i); // Pop the element at index i and delete v
-lval *lval_copy(lval *v);        // Create a copy of v
-char *ltype_name(int t);         // Return string representation of a type
+lval *lval_pop(lval *v, int i);                    // Pop the element at index i
+lval *lval_take(lval *v, int i);                   // Pop the element at index i and delete v
+lval *lval_copy(lval *v);                          // Create a copy of v (elements are shared)
+lval *lval_ref(lval *v);                           // Add a reference to v
+lval *lval_unshare(lval *v);                       // Return a version of v that can be modified
+void lval_own(lval *v);                            // Give a list a cell buffer of its own
+lval *lval_slice(lval *v, int start, int end);     // Elements of a list between two indexes
+void lval_move_cells(lval *v, lval **dst);         // Move the elements of a list out of its buffer
+int lcells_can_take(lval *v, lval **items, int n); // Check if a buffer can take elements in place
+char *ltype_name(int t);                           // Return string representation of a type
 
 // Built-in math functions
 lval *builtin_add(lenv *e, lval *args);
@@ -150,9 +700,54 @@ lval *builtin_head(lenv *e, lval *args);
 lval *builtin_tail(lenv *e, lval *args);
 lval *builtin_list(lenv *e, lval *args);
 lval *builtin_eval(lenv *e, lval *args);
+lval *lval_eval_expr(lval *args); // helper for builtin_eval
 lval *builtin_join(lenv *e, lval *args);
 lval *lval_join(lval *x, lval *y); // helper for builtin_join
 
+// Built-in list functions lib.clj used to define (still overridable)
+lval *builtin_len(lenv *e, lval *args);    // Number of elements
+lval *builtin_nth(lenv *e, lval *args);    // Element at an index
+lval *builtin_last(lenv *e, lval *args);   // Last element
+lval *builtin_take(lenv *e, lval *args);   // First n elements
+lval *builtin_drop(lenv *e, lval *args);   // All but the first n elements
+lval *builtin_elem(lenv *e, lval *args);   // Check if a value is an element
+lval *builtin_map(lenv *e, lval *args);    // Results of a function on each element
+lval *builtin_filter(lenv *e, lval *args); // Elements a predicate is true for
+lval *builtin_foldl(lenv *e, lval *args);  // Elements combined from the left
+
+// Built-in vector functions
+lval *builtin_vec(lenv *e, lval *args);    // Vector of the elements of a Q-Expression
+lval *builtin_vget(lenv *e, lval *args);   // Element at an index
+lval *builtin_vset(lenv *e, lval *args);   // Vector with the element at an index replaced
+lval *builtin_vlen(lenv *e, lval *args);   // Number of elements
+lval *builtin_vpush(lenv *e, lval *args);  // Vector with an element added at the end
+lval *builtin_vslice(lenv *e, lval *args); // Vector of the elements between two indexes
+
+// Hash maps
+unsigned lhash_mix(uint64_t x);                                           // Mix the bits of a word into a hash
+unsigned lval_hash(lval *v);                                              // Hash that agrees with lval_eq
+int lmap_ndata(lval *m);                                                  // Entries held directly by a node
+int lmap_nslots(lval *m);                                                 // Slots of a node
+void lmap_iter_init(lmap_iter *it, lval *m);                              // Start a walk over the entries
+lval **lmap_next(lmap_iter *it);                                          // Key and value of the next entry
+lval **lmap_find(lval *m, lval *k);                                       // Value of a key
+void lmap_open(lval *m, int len, int i, int n);                           // Make room for slots in a node
+void lmap_close(lval *m, int len, int i, int n);                          // Remove slots from a node
+lval *lmap_pair(lval **a, unsigned ha, lval **b, unsigned hb, int shift); // Node of two entries
+lval *lmap_assoc(lval *m, lval *k, lval *x, unsigned h, int shift);       // Node with the value of a key set
+void lmap_insert(lval *m, lval *k, lval *x, unsigned h, int shift);       // Set the value of a key in place
+lval *lmap_dissoc(lval *m, lval *k, unsigned h, int shift);               // Node without a key
+void lmap_put(lval *m, lval *k, lval *x);                                 // Set the value of a key in a new map
+lval *lmap_put_pairs(lval *m, lval *args);                                // Set keys and values given in turn
+
+// Built-in map functions
+lval *builtin_hash_map(lenv *e, lval *args); // Map of keys and values
+lval *builtin_get(lenv *e, lval *args);      // Value of a key
+lval *builtin_assoc(lenv *e, lval *args);    // Map with keys set
+lval *builtin_dissoc(lenv *e, lval *args);   // Map with keys removed
+lval *builtin_keys(lenv *e, lval *args);     // Keys of a map
+lval *builtin_vals(lenv *e, lval *args);     // Values of a map
+
 // Handle variable definitions
 lval *builtin_var(lenv *e, lval *args, char *func_name);
 lval *builtin_def(lenv *e, lval *args); // define in global environment
@@ -166,57 +761,154 @@ lval *builtin_gt(lenv *e, lval *args);
 lval *builtin_ge(lenv *e, lval *args);
 lval *builtin_lt(lenv *e, lval *args);
 lval *builtin_le(lenv *e, lval *args);
-lval *builtin_order(lenv *e, lval *args, char *op);
+lval *builtin_order(lenv *e, lval *args, int op);
 
 // Comparision - equality
 int lval_eq(lval *x, lval *y);
-lval *builtin_cmp(lenv *e, lval *args, char *op);
+lval *builtin_cmp(lenv *e, lval *args, int op);
 lval *builtin_eq(lenv *e, lval *args);
 lval *builtin_ne(lenv *e, lval *args);
 
 // Conditional
 lval *builtin_if(lenv *e, lval *args);
+lval *lval_if_branch(lval *args); // helper for builtin_if
+
+// Sequencing
+lval *builtin_do(lenv *e, lval *args); // Value of the last argument
 
 // File handling
-lval *builtin_load(lenv *e, lval *args); // Load a Lisp file
+lval *builtin_load(lenv *e, lval *args);  // Load a Lisp file
+lval *lenv_load(lenv *e, lreader *r);     // Evaluate the expressions of a reader
+int lfile_open(lfile *f, char *filename); // Map the contents of a file (or open a stream)
+void lfile_close(lfile *f);               // Release the contents of a file
+
+// Serialization and images
+char *lbuiltin_name(lbuiltin func);                    // Name a builtin was registered under
+lbuiltin lbuiltin_find(char *name);                    // Builtin registered under an interned name
+int lser_create(lser *s, char *filename, char *magic); // Start writing a file
+char *lser_commit(lser *s);                            // Finish writing a file
+void lser_byte(lser *s, int b);                        // Write a byte
+void lser_uint(lser *s, unsigned long x);              // Write an unsigned number
+void lser_int(lser *s, long x);                        // Write a signed number
+void lser_bytes(lser *s, char *p, long len);           // Write a length and the bytes
+int lser_number(lser *s, void *p, int *next);          // Number an object (-1 the first time)
+void lser_write_sym(lser *s, char *sym);               // Write an interned symbol
+void lser_write(lser *s, lval *v);                     // Write a value
+void lser_write_value(lser *s, lval *v);               // Write a value (nesting already counted)
+void lser_write_env(lser *s, lenv *e);                 // Write an environment
+void lser_write_bindings(lser *s, lenv *e);            // Write the bindings of an environment
+char *lser_open(lser *s, char *filename, char *magic); // Start reading a file
+char *lser_close(lser *s);                             // Finish reading a file
+void lser_fail(lser *s, char *msg);                    // Stop reading with an error
+int lser_get_byte(lser *s);                            // Read a byte
+unsigned long lser_get_uint(lser *s);                  // Read an unsigned number
+long lser_get_int(lser *s);                            // Read a signed number
+long lser_get_len(lser *s, int min_size);              // Read a length that fits in the input
+char *lser_get_bytes(lser *s, long *len);              // Read a length and the bytes
+char *lser_get_sym(lser *s);                           // Read a symbol (interned)
+void lser_add(lser *s, void *p, int is_env);           // Number an object read
+void *lser_get_ref(lser *s, int is_env);               // Read a reference to an object
+lval *lser_read(lser *s);                              // Read a value
+lval *lser_read_value(lser *s);                        // Read a value (nesting already counted)
+lenv *lser_read_env(lser *s);                          // Read an environment
+void lser_read_bindings(lser *s, lenv *e);             // Read bindings into an environment
+void lser_free(lser *s);                               // Release a serializer
+lval *limage_dump(lenv *e, char *filename);            // Write the global environment to a file
+lval *limage_load(lenv *e, char *filename);            // Read the global environment from a file
+lenv *lenv_global(lenv *e);                            // Global environment of an environment
+lval *builtin_serialize(lenv *e, lval *args);          // Write a value to a file
+lval *builtin_deserialize(lenv *e, lval *args);        // Read a value from a file
 
 // Builtin reporting
-lval *builtin_print(lenv *e, lval *args); // Print the arguments
+lval *builtin_print(lenv *e, lval *args);     // Print the arguments
+lval *builtin_to_string(lenv *e, lval *args); // Printed representation of a value
 lval *builtin_error(lenv *e, lval *args); // Print the string as an error
 
+// Memory
+lval *builtin_gc_stats(lenv *e, lval *args); // Statistics of the cycle collector
+
 int main(int argc, char **argv)
 {
-    // Create the parsers
-    Number = mpc_new("number");
-    Symbol = mpc_new("symbol");
-    String = mpc_new("string");
-    Comment = mpc_new("comment");
-    Sexpr = mpc_new("sexpr"); // S-Expression
-    Qexpr = mpc_new("qexpr"); // Q-Expression
-    Expr = mpc_new("expr");
-    Lispy = mpc_new("lispy");
-
-    // Define the parsing rules
-    mpca_lang(MPCA_LANG_DEFAULT,
-              "\
-    number  : /-?[0-9]+/ ; \
-    symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ; \
-    string  : /\"(\\\\.|[^\"])*\"/ ; \
-    comment : /;[^\\r\\n]*/ ; \
-    sexpr   : '(' <expr>* ')' ; \
-    qexpr   : '{' <expr>* '}' ; \
-    expr    : <number> | <symbol> | <string> | <comment> \
-            | <sexpr> | <qexpr> ; \
-    lispy   : /^/ <expr>* /$/ ; \
-    ",
-              Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+    // Measure the C stack from here
+    char stack_top;
+    lstack_base = (uintptr_t)&stack_top;
+    struct rlimit stack_rlimit;
+    if (getrlimit(RLIMIT_STACK, &stack_rlimit) == 0 &&
+        stack_rlimit.rlim_cur != RLIM_INFINITY &&
+        stack_rlimit.rlim_cur > 2 * LSTACK_RESERVE)
+    {
+        lstack_limit = stack_rlimit.rlim_cur - LSTACK_RESERVE;
+    }
+
+    // Set up the memory pools
+    lheap_init();
 
     // Create a new environment and register built-in functions
     lenv *e = lenv_new();
     lenv_add_builtins(e);
 
+    // Handle the arguments in order: options, images and files to load
+    // The interactive prompt starts when there is nothing to run
+    int run_count = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        lval *x = NULL;
+        if (strcmp(argv[i], "--vm") == 0)
+        {
+            // Compile to bytecode instead of walking the expressions
+            lvm_enabled = 1;
+        }
+        else if ((strcmp(argv[i], "--dump-image") == 0 ||
+                  strcmp(argv[i], "--load-image") == 0) &&
+                 i + 1 == argc)
+        {
+            x = lval_err("Missing image file after %s", argv[i]);
+            run_count++;
+        }
+        else if (strcmp(argv[i], "--dump-image") == 0)
+        {
+            // Snapshot the global environment, after the files before it
+            x = limage_dump(e, argv[++i]);
+            run_count++;
+        }
+        else if (strcmp(argv[i], "--load-image") == 0)
+        {
+            // Restore a snapshot instead of loading its sources again
+            x = limage_load(e, argv[++i]);
+        }
+        else if (strcmp(argv[i], "-") == 0 || strcmp(argv[i], "--stdin") == 0)
+        {
+            // Batch mode: evaluate standard input as a stream,
+            // without the prompt and line editing
+            lreader r;
+            lreader_init_fd(&r, "<stdin>", STDIN_FILENO);
+            x = lenv_load(e, &r);
+            lreader_free(&r);
+            run_count++;
+        }
+        else
+        {
+            // Argument list with single argument - the filename
+            lval *args = lval_add(lval_sexpr(), lval_str(argv[i]));
+
+            // Pass to load file function and get result
+            x = builtin_load(e, args);
+            run_count++;
+        }
+
+        // Report if error
+        if (x)
+        {
+            if (x->type == LVAL_ERR)
+            {
+                lval_println(x);
+            }
+            lval_del(x);
+        }
+    }
+
     // Interactive prompt
-    if (argc == 1)
+    if (run_count == 0)
     {
         // Print Version and Exit Instruction
         puts("Lispy version 0.0.0.0.1");
@@ -225,27 +917,32 @@ int main(int argc, char **argv)
         // Infinite loop
         while (1)
         {
-            // Output the prompt and get input
+            // Output the prompt and get input, stop at the end of input
             char *input = readline("lispy> ");
+            if (!input)
+            {
+                putchar('\n');
+                break;
+            }
 
             // Add input to history (retrieved with up and down arrows)
             add_history(input);
 
-            // Attempt to parse the input
-            mpc_result_t r;
-            if (mpc_parse("<stdin>", input, Lispy, &r))
+            // Attempt to read the input
+            lreader r;
+            lreader_init(&r, "<stdin>", input, strlen(input));
+            lval *v = lreader_all(&r);
+            lreader_free(&r);
+            if (v->type != LVAL_ERR)
             {
-                // Success parse: r.output is the AST
-                lval *x = lval_eval(e, lval_read(r.output));
+                lval *x = lvm_enabled ? lvm_eval(e, v) : lval_eval(e, v);
                 lval_println(x);
                 lval_del(x);
-
-                mpc_ast_delete(r.output);
             }
             else
             {
-                mpc_err_print(r.error);
-                mpc_err_delete(r.error);
+                puts(v->err);
+                lval_del(v);
             }
 
             // Free retrieved input
@@ -253,1194 +950,6224 @@ int main(int argc, char **argv)
         }
     }
 
-    // Supplied with list of files
-    if (argc >= 2)
-    {
-        // Note the first command-line argument is the program
-        for (int i = 1; i < argc; i++)
-        {
-            // Argument list with single argument - the filename
-            lval *args = lval_add(lval_sexpr(), lval_str(argv[i]));
-
-            // Pass to load file function and get result
-            lval *x = builtin_load(e, args);
-
-            // Report if error
-            if (x->type == LVAL_ERR)
-            {
-                lval_println(x);
-            }
-
-            lval_del(x);
-        }
-    }
-
-    // Cleanup
+    // Cleanup (lambdas defined at the top level refer back to the
+    // global environment, so its bindings are dropped first, the
+    // collector frees the remaining cycles)
+    lenv_clear(e);
     lenv_del(e);
-    mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+    lgc_collect();
+    lsym_cleanup();
+    lheap_cleanup();
 
     return 0;
 }
 
-// Construct new Number
-lval *lval_num(long x)
+// Set up the memory pools
+void lheap_init()
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
-    v->num = x;
-    return v;
+    heap.lvals = (lpool){sizeof(lval), NULL, NULL, 0, 0};
+    heap.lenvs = (lpool){sizeof(lenv), NULL, NULL, 0, 0};
+    for (int i = 0; i < LCELL_CLASSES; i++)
+    {
+        heap.cells[i] = (lpool){sizeof(lcells) + (sizeof(lval *) << i), NULL, NULL, 0, 0};
+    }
 }
 
-// Construct new Error
-lval *lval_err(char *fmt_str, ...)
+// Release all slabs
+void lheap_cleanup()
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
-
-    // Initialize va_list to read extra arguments after fmt_str
-    va_list variadic_args;
-    va_start(variadic_args, fmt_str);
-
-    // Allocate buffer for the error string
-    const int BUFFER_SIZE = 512;
-    v->err = malloc(BUFFER_SIZE);
-
-    // Format the variadic arguments into the buffer
-    vsnprintf(v->err, BUFFER_SIZE - 1, fmt_str, variadic_args);
-
-    // Shrink the error buffer to the exact size needed
-    v->err = realloc(v->err, strlen(v->err) + 1);
-
-    // Clean up va_list and return the constructed error value
-    va_end(variadic_args);
-    return v;
-}
+    lpool *pools[2 + LCELL_CLASSES] = {&heap.lvals, &heap.lenvs};
+    for (int i = 0; i < LCELL_CLASSES; i++)
+    {
+        pools[2 + i] = &heap.cells[i];
+    }
 
-// Construct new Symbol
-lval *lval_sym(char *s)
-{
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
-    return v;
+    for (int i = 0; i < 2 + LCELL_CLASSES; i++)
+    {
+        for (int j = 0; j < pools[i]->slab_count; j++)
+        {
+            free(pools[i]->slabs[j]);
+        }
+        free(pools[i]->slabs);
+        pools[i]->slabs = NULL;
+        pools[i]->slab_count = 0;
+        pools[i]->free = NULL;
+    }
 }
 
-// Construct new String
-lval *lval_str(char *str)
+// Take an object from a pool
+void *lpool_alloc(lpool *p)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_STR;
-    v->str = malloc(strlen(str) + 1);
-    strcpy(v->str, str);
-    return v;
-}
+    p->live++;
+#ifdef LISPY_USE_MALLOC
+    return malloc(p->size);
+#else
+    if (!p->free)
+    {
+        // Carve a new slab into objects and put them on the free list
+        char *slab = malloc(LPOOL_SLAB_SIZE);
+        p->slab_count++;
+        p->slabs = realloc(p->slabs, sizeof(char *) * p->slab_count);
+        p->slabs[p->slab_count - 1] = slab;
+
+        size_t n = LPOOL_SLAB_SIZE / p->size;
+        for (size_t i = 0; i < n; i++)
+        {
+            void *obj = slab + (n - 1 - i) * p->size;
+            *(void **)obj = p->free;
+            p->free = obj;
+        }
+    }
 
-// Construct new S-Expression
-lval *lval_sexpr()
-{
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+    void *obj = p->free;
+    p->free = *(void **)obj;
+    return obj;
+#endif
 }
 
-// Construct new Q-Expression
-lval *lval_qexpr()
+// Return an object to a pool
+void lpool_free(lpool *p, void *obj)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+    p->live--;
+#ifdef LISPY_USE_MALLOC
+    free(obj);
+#else
+    *(void **)obj = p->free;
+    p->free = obj;
+#endif
 }
 
-// Construct new function
-lval *lval_fun(lbuiltin func)
+// Allocate an lval holding a single reference
+lval *lval_alloc()
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
-    v->builtin = func;
+    lval *v = lpool_alloc(&heap.lvals);
+    v->refs = 1;
     return v;
 }
 
-// Construct new user-defined function
-lval *lval_lambda(lval *formals, lval *body)
+// Release the memory of an lval
+void lval_free(lval *v)
 {
-    lval *v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
-
-    v->builtin = NULL;
-    v->env = lenv_new();
-
-    v->formals = formals;
-    v->body = body;
-
-    return v;
+    lpool_free(&heap.lvals, v);
 }
 
-// Delete a Lisp value
-void lval_del(lval *v)
+// Number of slots reserved for a cell array of n elements
+// (the next power of 2, which is also the size class)
+int lcells_capacity(int n)
 {
-    switch (v->type)
+    int cap = 1;
+    while (cap < n)
     {
-    case LVAL_NUM:
-        break;
-    case LVAL_FUN:
-        // Handle user-defined function
-        if (!v->builtin)
-        {
-            lenv_del(v->env);
-            lval_del(v->formals);
-            lval_del(v->body);
-        }
-
-        break;
-    case LVAL_ERR:
-        free(v->err);
-        break;
-    case LVAL_SYM:
-        free(v->sym);
-        break;
-    case LVAL_STR:
-        free(v->str);
-        break;
-    case LVAL_SEXPR:
-    case LVAL_QEXPR:
-        for (int i = 0; i < v->count; i++)
-        {
-            lval_del(v->cell[i]);
-        }
-
-        free(v->cell);
-        break;
-    default:
-        break;
+        cap <<= 1;
     }
-
-    free(v);
+    return n ? cap : 0;
 }
 
-// Construct Number from an AST node
-lval *lval_read_num(mpc_ast_t *t)
+// Index of the pool serving cell arrays of the given capacity
+int lcells_class(int cap)
 {
-    errno = 0;
-    long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE ? lval_num(x) : lval_err("Invalid number: %s", t->contents);
+    int class = 0;
+    while ((1 << class) < cap)
+    {
+        class++;
+    }
+    return class;
 }
 
-// Construct String from an AST node
-lval *lval_read_str(mpc_ast_t *t)
+// Allocate an empty cell buffer of cap slots (cap from lcells_capacity)
+// with a single reference
+// Small buffers come from the size-class pools, large ones from malloc
+lcells *lcells_alloc(int cap)
 {
-    // Cut off the final quote character
-    t->contents[strlen(t->contents) - 1] = '\0';
-
-    // Copy the string except for the first quote character
-    // Note: (t->contents + 1) -> pointer arithmetic
-    char *unescaped = malloc(strlen(t->contents + 1) + 1);
-    strcpy(unescaped, t->contents + 1);
-
-    // Un-escape the string
-    unescaped = mpcf_unescape(unescaped);
-
-    // Construct a new lval
-    lval *str = lval_str(unescaped);
-
-    // Free the string and return the lval
-    free(unescaped);
-    return str;
+    lcells *b = NULL;
+#ifndef LISPY_USE_MALLOC
+    if (cap <= LCELL_POOLED_MAX)
+    {
+        b = lpool_alloc(&heap.cells[lcells_class(cap)]);
+    }
+#endif
+    if (!b)
+    {
+        b = malloc(sizeof(lcells) + sizeof(lval *) * cap);
+    }
+    b->refs = 1;
+    b->capacity = cap;
+    b->lo = 0;
+    b->hi = 0;
+    return b;
 }
 
-// Add element to S-expression or a Q-expression
-lval *lval_add(lval *v, lval *x)
+// Release the memory of a cell buffer
+void lcells_free(lcells *b)
 {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-    v->cell[v->count - 1] = x;
-    return v;
+#ifndef LISPY_USE_MALLOC
+    if (b->capacity <= LCELL_POOLED_MAX)
+    {
+        lpool_free(&heap.cells[lcells_class(b->capacity)], b);
+        return;
+    }
+#endif
+    free(b);
 }
 
-// Construct Lisp value from an AST node
-lval *lval_read(mpc_ast_t *t)
+// Drop a reference to a cell buffer, and its elements with the last one
+void lcells_release(lcells *b)
 {
-    // Handle number
-    if (strstr(t->tag, "number"))
+    if (--b->refs > 0)
     {
-        return lval_read_num(t);
+        return;
     }
-
-    // Handle symbol
-    if (strstr(t->tag, "symbol"))
+    for (int i = b->lo; i < b->hi; i++)
     {
-        return lval_sym(t->contents);
+        lval_del(b->slots[i]);
     }
+    lcells_free(b);
+}
 
-    // Handle string
-    if (strstr(t->tag, "string"))
+// Track a new environment
+void lgc_track(lenv *e)
+{
+    e->gc_prev = NULL;
+    e->gc_next = gc.envs;
+    if (gc.envs)
     {
-        return lval_read_str(t);
+        gc.envs->gc_prev = e;
     }
+    gc.envs = e;
+    gc.env_count++;
+}
 
-    lval *x = NULL;
-
-    if (strcmp(t->tag, ">") == 0 || strstr(t->tag, "sexpr"))
+// Stop tracking a deleted environment
+void lgc_untrack(lenv *e)
+{
+    if (e->gc_prev)
     {
-        // Handle root and S-expression
-        x = lval_sexpr();
+        e->gc_prev->gc_next = e->gc_next;
     }
-    else if (strstr(t->tag, "qexpr"))
+    else
     {
-        // Handle Q-expression
-        x = lval_qexpr();
+        gc.envs = e->gc_next;
     }
-
-    // Adding valid expressions from children
-    for (int i = 0; i < t->children_num; i++)
+    if (e->gc_next)
     {
-        if (strcmp(t->children[i]->contents, "(") == 0 ||
-            strcmp(t->children[i]->contents, ")") == 0 ||
-            strcmp(t->children[i]->contents, "{") == 0 ||
-            strcmp(t->children[i]->contents, "}") == 0 ||
-            strcmp(t->children[i]->tag, "regex") == 0 ||
-            strcmp(t->children[i]->tag, "comment") == 0)
-        {
-            continue;
-        }
-
-        x = lval_add(x, lval_read(t->children[i]));
+        e->gc_next->gc_prev = e->gc_prev;
     }
-
-    return x;
+    gc.env_count--;
 }
 
-// Print an S-expression or a Q-expression
-void lval_expr_print(lval *v, char open, char close)
+// Check if a value can refer to other values or environments
+int lgc_container(lval *v)
 {
-    putchar(open);
-
-    for (int i = 0; i < v->count; i++)
+    switch (v->type)
     {
-        lval_print(v->cell[i]);
-
-        if (i != (v->count - 1))
-        {
-            putchar(' ');
-        }
+    case LVAL_FUN:
+        return !v->builtin;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_VEC:
+        return v->count > 0;
+    case LVAL_MAP:
+        return v->nentries > 0;
+    default:
+        return 0;
     }
-
-    putchar(close);
 }
 
-// Print a string
-void lval_print_str(lval *v)
+// Scratch count of a value or cell buffer reachable from the environments
+// NULL if the node has not been seen yet, unless insert is set (the node
+// is then added with a count of 0)
+int *lgc_count(void *node, int kind, int insert)
 {
-    // Make a copy of the string
-    char *escaped = malloc(strlen(v->str) + 1);
-    strcpy(escaped, v->str);
+    // Keep the table at most half full
+    if (insert && (gc.count + 1) * 2 > gc.size)
+    {
+        int size = gc.size ? gc.size * 2 : 1024;
+        uintptr_t *keys = calloc(size, sizeof(uintptr_t));
+        int *counts = malloc(sizeof(int) * size);
 
-    // Escape
-    escaped = mpcf_escape(escaped);
+        for (int i = 0; i < gc.size; i++)
+        {
+            if (gc.keys[i])
+            {
+                unsigned j = lsym_hash((char *)(gc.keys[i] & ~(uintptr_t)3)) & (size - 1);
+                while (keys[j])
+                {
+                    j = (j + 1) & (size - 1);
+                }
+                keys[j] = gc.keys[i];
+                counts[j] = gc.counts[i];
+            }
+        }
 
-    // Print between double quotes
-    printf("\"%s\"", escaped);
+        free(gc.keys);
+        free(gc.counts);
+        gc.keys = keys;
+        gc.counts = counts;
+        gc.size = size;
+    }
 
-    // Free the copied string
-    free(escaped);
-}
+    if (!gc.size)
+    {
+        return NULL;
+    }
 
-// Print a Lisp value
-void lval_print(lval *v)
-{
-    switch (v->type)
+    uintptr_t key = (uintptr_t)node | kind;
+    unsigned mask = gc.size - 1;
+    for (unsigned i = lsym_hash(node) & mask;; i = (i + 1) & mask)
     {
-    case LVAL_NUM:
-        printf("%li", v->num);
-        break;
-    case LVAL_ERR:
-        printf("Error: %s", v->err);
-        break;
-    case LVAL_SYM:
-        printf("%s", v->sym);
-        break;
-    case LVAL_STR:
-        lval_print_str(v);
-        break;
-    case LVAL_SEXPR:
-        lval_expr_print(v, '(', ')');
-        break;
-    case LVAL_QEXPR:
-        lval_expr_print(v, '{', '}');
-        break;
-    case LVAL_FUN:
-        if (v->builtin)
+        if (gc.keys[i] == key)
         {
-            printf("<builtin>");
+            return &gc.counts[i];
         }
-        else
+        if (!gc.keys[i])
         {
-            printf("(\\ ");
-            lval_print(v->formals);
-            putchar(' ');
-            lval_print(v->body);
-            putchar(')');
+            if (!insert)
+            {
+                return NULL;
+            }
+            gc.keys[i] = key;
+            gc.counts[i] = 0;
+            gc.count++;
+            return &gc.counts[i];
         }
-        break;
-    default:
-        break;
     }
 }
 
-// Print a Lisp value followed by a new line
-void lval_println(lval *v)
+// Add a node (value, environment or cell buffer) to the work list
+void lgc_push(void *node, int kind)
 {
-    lval_print(v);
-    putchar('\n');
+    if (gc.work_count == gc.work_capacity)
+    {
+        gc.work_capacity = gc.work_capacity ? gc.work_capacity * 2 : 256;
+        gc.work = realloc(gc.work, sizeof(uintptr_t) * gc.work_capacity);
+    }
+    // Nodes are at least 4-byte aligned, the low bits tag the kind
+    gc.work[gc.work_count++] = (uintptr_t)node | kind;
 }
 
-// Function call
-lval *lval_call(lenv *e, lval *f, lval *args)
+// First pass: remove a reference coming from inside the graph
+void lgc_subtract(void *node, int kind)
 {
-    // Overview:
-    // - If the function is builtin, just call it
-    // - Bind the arguments to the formal arguments:
-    //   + Evaluate and return the result if fully bound
-    //   + Return a partially-evaluated function if not
-
-    // Handle builtin function
-    if (f->builtin)
+    if (kind == LGC_ENV)
     {
-        return f->builtin(e, args);
+        ((lenv *)node)->gc_refs--;
+        return;
     }
 
-    // Record formal arguments and arguments count
-    int total = f->formals->count;
-    int given = args->count;
+    int *count = lgc_count(node, kind, 0);
+    if (!count)
+    {
+        // First time seen: scan it too
+        count = lgc_count(node, kind, 1);
+        *count = kind == LGC_CELLS ? ((lcells *)node)->refs : ((lval *)node)->refs;
+        lgc_push(node, kind);
+    }
+    (*count)--;
+}
 
-    while (args->count)
+// Second pass: mark a node held (directly or not) from outside
+void lgc_mark(void *node, int kind)
+{
+    if (kind == LGC_ENV)
     {
-        if (f->formals->count == 0)
+        lenv *e = node;
+        if (e->gc_refs != LGC_LIVE)
         {
-            lval_del(args);
-            return lval_err("Function get passed too many arguments. Expected %i. Got %i.",
-                            total, given);
+            e->gc_refs = LGC_LIVE;
+            lgc_push(e, LGC_ENV);
         }
+        return;
+    }
 
-        // Pop the next formal argument
-        lval *sym = lval_pop(f->formals, 0);
+    int *count = lgc_count(node, kind, 0);
+    if (count && *count != LGC_LIVE)
+    {
+        *count = LGC_LIVE;
+        lgc_push(node, kind);
+    }
+}
 
-        // Handle variadic function
-        if (strcmp(sym->sym, "&") == 0)
+// Visit the references held by a node
+void lgc_visit(void *node, int kind, void (*visit)(void *, int))
+{
+    if (kind == LGC_ENV)
+    {
+        lenv *e = node;
+        gc.scanned += 1 + e->count;
+        if (e->parent)
         {
-            // Ensure & is followed by a single symbol
-            if (f->formals->count != 1)
+            visit(e->parent, LGC_ENV);
+        }
+        for (int i = 0; i < e->count; i++)
+        {
+            if (lgc_container(e->vals[i]))
             {
-                lval_del(args);
-                return lval_err("Invalid function format. Symbol'&' not followed by a single symbol");
+                visit(e->vals[i], LGC_VALUE);
             }
-
-            // The next formal arguments should be bound to remaining arguments
-            lval *nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, args));
-
-            lval_del(sym);
-            lval_del(nsym);
-            break;
         }
-
-        // Pop the next argument
-        lval *val = lval_pop(args, 0);
-
-        // Binding in function's environment
-        lenv_put(f->env, sym, val);
-
-        // Delete symbol and value
-        lval_del(sym);
-        lval_del(val);
+        return;
     }
 
-    // Clean up argument list after binding
-    lval_del(args);
-
-    // If '&' remains bind the next symbol to the empty list
-    if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0)
+    if (kind == LGC_CELLS)
     {
-        // Ensure & is followed by a single symbol
-        if (f->formals->count != 2)
+        lcells *b = node;
+        gc.scanned += b->hi - b->lo;
+        for (int i = b->lo; i < b->hi; i++)
         {
-            return lval_err("Invalid function format. Symbol'&' not followed by a single symbol");
+            if (lgc_container(b->slots[i]))
+            {
+                visit(b->slots[i], LGC_VALUE);
+            }
         }
+        return;
+    }
 
-        // Pop and delete the '&' symbol
-        lval_del(lval_pop(f->formals, 0));
-
-        // Bind empty list to the next symbol in function's environment
-        lval *sym = lval_pop(f->formals, 0);
-        lval *val = lval_qexpr();
-        lenv_put(f->env, sym, val);
+    lval *v = node;
+    if (v->type == LVAL_FUN)
+    {
+        gc.scanned += 3;
+        visit(v->env, LGC_ENV);
+        visit(v->formals, LGC_VALUE);
+        visit(v->body, LGC_VALUE);
 
-        // Delete symbol and value
-        lval_del(sym);
-        lval_del(val);
+        // Constants of compiled code only this function uses
+        if (v->code && v->code->refs == 1)
+        {
+            for (int i = 0; i < v->code->const_count; i++)
+            {
+                if (lgc_container(v->code->consts[i]))
+                {
+                    visit(v->code->consts[i], LGC_VALUE);
+                }
+            }
+        }
+        return;
     }
 
-    if (f->formals->count == 0)
+    if (v->type == LVAL_MAP)
     {
-        // Evaluate if all formal arguments have been bound
-        f->env->parent = e;
-        return builtin_eval(
-            f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+        // Keys, values and the nodes below
+        int n = lmap_nslots(v);
+        gc.scanned += n;
+        for (int i = 0; i < n; i++)
+        {
+            if (lgc_container(v->slots[i]))
+            {
+                visit(v->slots[i], LGC_VALUE);
+            }
+        }
+        return;
     }
-    else
+
+    // A buffer only this list uses is part of it
+    if (v->buf->refs > 1)
     {
-        // Return partially-evaluated function
-        return lval_copy(f);
+        gc.scanned += 1;
+        visit(v->buf, LGC_CELLS);
+        return;
     }
+    lgc_visit(v->buf, LGC_CELLS, visit);
 }
 
-// Evaluate an S-expression
-lval *lval_eval_sexpr(lenv *e, lval *v)
+// Scan the nodes on the work list until it is empty
+void lgc_drain(void (*visit)(void *, int))
 {
-    // Empty expression
-    if (v->count == 0)
+    while (gc.work_count > 0)
     {
-        return v;
+        uintptr_t node = gc.work[--gc.work_count];
+        lgc_visit((void *)(node & ~(uintptr_t)3), node & 3, visit);
     }
+}
 
-    // Evaluate children
-    for (int i = 0; i < v->count; i++)
+// Free the cycles of environments no longer in use
+void lgc_collect()
+{
+    clock_t start = clock();
+
+    // Count the references from inside the graph of environments and the
+    // values reachable from them
+    for (lenv *e = gc.envs; e; e = e->gc_next)
+    {
+        e->gc_refs = e->refs;
+    }
+    for (lenv *e = gc.envs; e; e = e->gc_next)
     {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+        lgc_push(e, LGC_ENV);
+    }
+    lgc_drain(lgc_subtract);
 
-        // Error checking
-        if (v->cell[i]->type == LVAL_ERR)
+    // Nodes with references left are held from outside, keep everything
+    // they reach
+    for (lenv *e = gc.envs; e; e = e->gc_next)
+    {
+        if (e->gc_refs > 0)
         {
-            return lval_take(v, i);
+            lgc_mark(e, LGC_ENV);
         }
     }
-
-    // Single expression
-    if (v->count == 1)
+    for (int i = 0; i < gc.size; i++)
     {
-        return lval_take(v, 0);
+        if (gc.keys[i] && gc.counts[i] > 0)
+        {
+            lgc_mark((void *)(gc.keys[i] & ~(uintptr_t)3), gc.keys[i] & 3);
+        }
     }
+    lgc_drain(lgc_mark);
 
-    // Ensure the first element (after evaluation) is a function
-    lval *f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN)
+    // The other environments are only referenced from cycles: clearing
+    // their bindings breaks the cycles (held meanwhile so none is freed
+    // while still on the list)
+    for (lenv *e = gc.envs; e; e = e->gc_next)
     {
-        lval *err = lval_err("S-expression must start with a function! Got %s",
-                             ltype_name(f->type));
-        lval_del(f);
-        lval_del(v);
-        return err;
+        if (e->gc_refs != LGC_LIVE)
+        {
+            lgc_push(lenv_ref(e), LGC_ENV);
+        }
     }
-
-    // Call function to get result
-    lval *result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
-}
-
-// Evaluate a Lisp value
-lval *lval_eval(lenv *e, lval *v)
-{
-    // Variable resolution
-    if (v->type == LVAL_SYM)
+    int garbage = gc.work_count;
+    for (int i = 0; i < garbage; i++)
     {
-        lval *x = lenv_get(e, v);
-        lval_del(v);
-        return x;
+        lenv_clear((lenv *)(gc.work[i] & ~(uintptr_t)3));
     }
-
-    // Evaluate S-expression
-    if (v->type == LVAL_SEXPR)
+    for (int i = 0; i < garbage; i++)
     {
-        return lval_eval_sexpr(e, v);
+        lenv_del((lenv *)(gc.work[i] & ~(uintptr_t)3));
     }
 
-    // Other types remain the same
-    return v;
+    // Release the scratch space
+    free(gc.keys);
+    free(gc.counts);
+    free(gc.work);
+    gc.keys = NULL;
+    gc.counts = NULL;
+    gc.work = NULL;
+    gc.size = gc.count = 0;
+    gc.work_count = gc.work_capacity = 0;
+
+    // Collect again after allocating as many environments as references
+    // were scanned (in both passes), so the work per allocation stays constant as the heap
+    // grows
+    gc.allocated = 0;
+    gc.threshold = gc.scanned > LGC_THRESHOLD_MIN ? gc.scanned : LGC_THRESHOLD_MIN;
+    gc.scanned = 0;
+
+    long pause = (long)((clock() - start) * 1000000.0 / CLOCKS_PER_SEC);
+    gc.collections++;
+    gc.reclaimed += garbage;
+    gc.pause_total += pause;
+    if (pause > gc.pause_max)
+    {
+        gc.pause_max = pause;
+    }
 }
 
-// Pop the element at index i from an S-expression
-lval *lval_pop(lval *v, int i)
+// Hash the len characters of a symbol name (FNV-1a)
+unsigned lsym_hash_name(char *name, int len)
 {
-    // Find the item at index i
-    lval *x = v->cell[i];
-
-    // Shift memory after the item at 'i' backward
-    memmove(
-        &v->cell[i],                        // destination start
-        &v->cell[i + 1],                    // source start
-        sizeof(lval *) * (v->count - 1 - i) // number of bytes to move
-    );
-
-    // Decrease the item count and shrink the memory used
-    v->count--;
-    v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-
-    // Return the popped element
-    return x;
+    unsigned h = 2166136261u;
+    for (char *c = name; c < name + len; c++)
+    {
+        h = (h ^ (unsigned char)*c) * 16777619u;
+    }
+    return h;
 }
 
-// Similar to lval_pop, but also delete the original value
-lval *lval_take(lval *v, int i)
+// Hash an interned symbol by its address
+unsigned lsym_hash(char *sym)
 {
-    lval *x = lval_pop(v, i);
-    lval_del(v);
-    return x;
+    uintptr_t p = (uintptr_t)sym;
+    return (unsigned)((p >> 4) ^ (p >> 20)) * 2654435761u;
 }
 
-// Create a copy of v
-lval *lval_copy(lval *v)
+// Return the unique copy of a symbol name, adding it to the table if needed
+char *lsym_intern(char *name)
 {
-    lval *x = malloc(sizeof(lval));
-    x->type = v->type;
+    return lsym_intern_len(name, strlen(name));
+}
 
-    switch (v->type)
+// Return the unique copy of the first len characters of name
+// The reader interns symbols straight from the source text with it
+char *lsym_intern_len(char *name, int len)
+{
+    // Keep the table at most half full
+    if ((symtab.count + 1) * 2 > symtab.size)
     {
-    // Copy number directly
-    case LVAL_NUM:
-        x->num = v->num;
-        break;
+        int size = symtab.size ? symtab.size * 2 : 256;
+        char **slots = calloc(size, sizeof(char *));
 
-    case LVAL_FUN:
-        if (v->builtin)
-        {
-            // Copy function pointer directly
-            x->builtin = v->builtin;
-        }
-        else
+        for (int i = 0; i < symtab.size; i++)
         {
-            // Handle user-defined function
-            x->builtin = NULL;
-            x->env = lenv_copy(v->env);
-            x->formals = lval_copy(v->formals);
-            x->body = lval_copy(v->body);
+            if (symtab.slots[i])
+            {
+                char *slot = symtab.slots[i];
+                unsigned j = lsym_hash_name(slot, strlen(slot)) & (size - 1);
+                while (slots[j])
+                {
+                    j = (j + 1) & (size - 1);
+                }
+                slots[j] = symtab.slots[i];
+            }
         }
-        break;
 
-    // Copy string for error, symbol, string
-    case LVAL_ERR:
-        x->err = malloc(strlen(v->err) + 1);
-        strcpy(x->err, v->err);
-        break;
-    case LVAL_SYM:
-        x->sym = malloc(strlen(v->sym) + 1);
-        strcpy(x->sym, v->sym);
-        break;
-    case LVAL_STR:
-        x->str = malloc(strlen(v->str) + 1);
-        strcpy(x->str, v->str);
-        break;
+        free(symtab.slots);
+        symtab.slots = slots;
+        symtab.size = size;
+    }
 
-    // Copy List by copying each sub-expression
-    case LVAL_SEXPR:
-    case LVAL_QEXPR:
-        x->count = v->count;
-        x->cell = malloc(sizeof(lval *) * x->count);
-        for (int i = 0; i < x->count; i++)
+    // Linear probing until the name or an empty slot is found
+    unsigned i = lsym_hash_name(name, len) & (symtab.size - 1);
+    while (symtab.slots[i])
+    {
+        char *slot = symtab.slots[i];
+        if (strncmp(slot, name, len) == 0 && slot[len] == '\0')
         {
-            x->cell[i] = lval_copy(v->cell[i]);
+            return slot;
         }
-        break;
+        i = (i + 1) & (symtab.size - 1);
     }
 
-    return x;
+    symtab.slots[i] = malloc(len + 1);
+    memcpy(symtab.slots[i], name, len);
+    symtab.slots[i][len] = '\0';
+    symtab.count++;
+    return symtab.slots[i];
 }
 
-// Return string representation of a type
-char *ltype_name(int t)
+// Free all symbol names
+void lsym_cleanup()
 {
-    switch (t)
+    for (int i = 0; i < symtab.size; i++)
     {
-    case LVAL_FUN:
-        return "Function";
-    case LVAL_NUM:
-        return "Number";
-    case LVAL_ERR:
-        return "Error";
-    case LVAL_SYM:
-        return "Symbol";
-    case LVAL_STR:
-        return "String";
-    case LVAL_SEXPR:
-        return "S-Expression";
-    case LVAL_QEXPR:
-        return "Q-Expression";
-    default:
-        return "Unknown";
+        free(symtab.slots[i]);
     }
+    free(symtab.slots);
+    symtab = (lsymtab){0, 0, NULL};
 }
 
-// Apply the operation on the argument list
-lval *builtin_op(lenv *e, lval *args, char *op)
+// Construct new Number
+lval *lval_num(long x)
 {
-    // Ensure all arguments are numbers
-    for (int i = 0; i < args->count; i++)
-    {
-        LASSERT_ARG_TYPE(op, args, i, LVAL_NUM);
-    }
+    lval *v = lval_alloc();
+    v->type = LVAL_NUM;
+    v->num = x;
+    return v;
+}
 
-    // Pop the first argument
-    lval *x = lval_pop(args, 0);
+// Construct new Bignum
+// The value is zero, with nlimbs zeroed limbs to be filled in
+lval *lval_big(int neg, int nlimbs)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_BIG;
+    v->neg = neg;
+    v->nlimbs = nlimbs;
+    v->limbs = nlimbs ? calloc(nlimbs, sizeof(uint32_t)) : NULL;
+    return v;
+}
 
-    // Perform unary negation
-    if (args->count == 0 && strcmp(op, "-") == 0)
-    {
-        x->num = -x->num;
-        lval_del(args);
-        return x;
-    }
+// Construct new floating point number
+lval *lval_dbl(double x)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_DBL;
+    v->dbl = x;
+    return v;
+}
 
-    // While there are arguments remaining
-    while (args->count > 0)
-    {
-        // Pop the next element
-        lval *y = lval_pop(args, 0);
+// Construct new Error
+lval *lval_err(char *fmt_str, ...)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_ERR;
 
-        if (strcmp(op, "+") == 0)
-        {
-            x->num += y->num;
-        }
-        else if (strcmp(op, "-") == 0)
-        {
-            x->num -= y->num;
-        }
-        else if (strcmp(op, "*") == 0)
-        {
-            x->num *= y->num;
+    // Initialize va_list to read extra arguments after fmt_str
+    va_list variadic_args;
+    va_start(variadic_args, fmt_str);
+
+    // Allocate buffer for the error string
+    const int BUFFER_SIZE = 512;
+    v->err = malloc(BUFFER_SIZE);
+
+    // Format the variadic arguments into the buffer
+    vsnprintf(v->err, BUFFER_SIZE - 1, fmt_str, variadic_args);
+
+    // Shrink the error buffer to the exact size needed
+    v->err = realloc(v->err, strlen(v->err) + 1);
+
+    // Clean up va_list and return the constructed error value
+    va_end(variadic_args);
+    return v;
+}
+
+// Construct new Symbol
+lval *lval_sym(char *s)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_SYM;
+    v->sym = lsym_intern(s);
+    return v;
+}
+
+// Construct new String
+lval *lval_str(char *str)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_STR;
+    v->str = malloc(strlen(str) + 1);
+    strcpy(v->str, str);
+    return v;
+}
+
+// Construct new String from the first len characters of str
+lval *lval_str_len(char *str, long len)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_STR;
+    v->str = malloc(len + 1);
+    memcpy(v->str, str, len);
+    v->str[len] = '\0';
+    return v;
+}
+
+// Construct new S-Expression
+lval *lval_sexpr()
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_SEXPR;
+    v->count = 0;
+    v->cell = NULL;
+    v->buf = NULL;
+    return v;
+}
+
+// Construct new Q-Expression
+lval *lval_qexpr()
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_QEXPR;
+    v->count = 0;
+    v->cell = NULL;
+    v->buf = NULL;
+    return v;
+}
+
+// Construct new Vector
+// Elements are stored like those of an expression, in a cell buffer
+lval *lval_vec()
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_VEC;
+    v->count = 0;
+    v->cell = NULL;
+    v->buf = NULL;
+    return v;
+}
+
+// Construct new empty hash map
+lval *lval_map()
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_MAP;
+    v->nentries = 0;
+    v->datamap = 0;
+    v->nodemap = 0;
+    v->slots = NULL;
+    return v;
+}
+
+// Construct new function
+lval *lval_fun(lbuiltin func)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_FUN;
+    v->builtin = func;
+    return v;
+}
+
+// Construct new user-defined function
+// Takes over the caller's reference to env, the environment it closes over
+lval *lval_lambda(lenv *env, lval *formals, lval *body)
+{
+    lval *v = lval_alloc();
+    v->type = LVAL_FUN;
+
+    v->builtin = NULL;
+    v->env = env;
+
+    v->formals = formals;
+    v->body = body;
+    v->code = NULL;
+
+    return v;
+}
+
+// Delete a Lisp value (drop a reference, free with the last one)
+void lval_del(lval *v)
+{
+    if (--v->refs > 0)
+    {
+        return;
+    }
+
+    switch (v->type)
+    {
+    case LVAL_NUM:
+    case LVAL_DBL:
+        break;
+    case LVAL_BIG:
+        free(v->limbs);
+        break;
+    case LVAL_FUN:
+        // Handle user-defined function
+        if (!v->builtin)
+        {
+            lenv_del(v->env);
+            lval_del(v->formals);
+            lval_del(v->body);
+            if (v->code)
+            {
+                lcode_del(v->code);
+            }
+        }
+
+        break;
+    case LVAL_ERR:
+        free(v->err);
+        break;
+    case LVAL_SYM:
+        // Symbol names belong to the symbol table
+        break;
+    case LVAL_STR:
+        free(v->str);
+        break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_VEC:
+        // The buffer holds the references to the elements
+        if (v->buf)
+        {
+            lcells_release(v->buf);
+        }
+        break;
+    case LVAL_MAP:
+        for (int i = lmap_nslots(v) - 1; i >= 0; i--)
+        {
+            lval_del(v->slots[i]);
+        }
+        free(v->slots);
+        break;
+    default:
+        break;
+    }
+
+    lval_free(v);
+}
+
+// Construct Number from the text of a number literal
+lval *lval_read_num(char *s)
+{
+    // A fraction or an exponent makes it a float
+    if (strpbrk(s, ".eE"))
+    {
+        return lval_dbl(strtod(s, NULL));
+    }
+
+    errno = 0;
+    long x = strtol(s, NULL, 10);
+    if (errno == ERANGE)
+    {
+        // Too large for a number
+        return lval_big_norm(lval_big_read(s));
+    }
+    return lval_num(x);
+}
+
+// Make room for n elements from the first element of v (not shared)
+// The slots after the list are free when it ends where the elements of its
+// buffer do, even if other lists share the buffer
+void lval_reserve(lval *v, int n)
+{
+    lcells *b = v->buf;
+    if (n <= v->count || (b && v->cell + v->count == b->slots + b->hi &&
+                          v->cell + n <= b->slots + b->capacity))
+    {
+        return;
+    }
+
+    // Move the elements into a new buffer, grown geometrically
+    int count = v->count;
+    lcells *x = lcells_alloc(lcells_capacity(n > 2 * count ? n : 2 * count));
+    lval_move_cells(v, x->slots);
+    x->hi = count;
+    v->count = count;
+    v->cell = x->slots;
+    v->buf = x;
+}
+
+// Add element to S-expression or a Q-expression (not shared)
+lval *lval_add(lval *v, lval *x)
+{
+    if (v->buf && !lcells_can_take(v, &x, 1))
+    {
+        lval_own(v);
+    }
+    lval_reserve(v, v->count + 1);
+    v->cell[v->count] = x;
+    v->count++;
+    v->buf->hi++;
+    return v;
+}
+
+// Set up a reader over len bytes of source text
+void lreader_init(lreader *r, char *filename, char *src, long len)
+{
+    r->filename = filename;
+    r->start = src;
+    r->pos = src;
+    r->end = src + len;
+    r->row = 0;
+    r->fd = -1;
+    r->capacity = 0;
+    r->error = 0;
+    r->scan = 0;
+    r->scan_depth = 0;
+    r->scan_mode = LSCAN_CODE;
+    r->depth = 0;
+    r->buf = NULL;
+    r->buf_size = 0;
+}
+
+// Set up a reader over the input of a file descriptor
+void lreader_init_fd(lreader *r, char *filename, int fd)
+{
+    lreader_init(r, filename, malloc(LREADER_CHUNK), 0);
+    r->fd = fd;
+    r->capacity = LREADER_CHUNK;
+}
+
+// Read more input from the file descriptor, after the buffered input
+// Input before the line being read is dropped to make room
+// Returns the number of bytes read, 0 at the end of the input or when
+// reading fails (the error is kept in r->error)
+int lreader_fill(lreader *r)
+{
+    if (r->fd < 0 || r->error)
+    {
+        return 0;
+    }
+
+    // Drop the lines before the current one
+    char *line = r->pos;
+    while (line > r->start && line[-1] != '\n')
+    {
+        line--;
+    }
+    for (char *c = r->start; c < line; c++)
+    {
+        r->row += *c == '\n';
+    }
+    long offset = r->pos - line;
+    long len = r->end - line;
+    memmove(r->start, line, len);
+
+    // Grow the buffer when an expression fills most of it
+    if (r->capacity - len < LREADER_CHUNK / 2)
+    {
+        r->capacity *= 2;
+        r->start = realloc(r->start, r->capacity);
+    }
+    r->pos = r->start + offset;
+    r->end = r->start + len;
+
+    ssize_t n;
+    do
+    {
+        n = read(r->fd, r->end, r->capacity - len);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+    {
+        r->error = errno;
+        return 0;
+    }
+    if (n == 0)
+    {
+        return 0;
+    }
+    r->end += n;
+    return n;
+}
+
+// Check if the buffered input holds a whole top-level expression (or a
+// syntax error the reader reports), so reading it cannot run out of input
+// Only scans brackets, strings and comments: the reader checks the rest
+// When the input runs out, the scan resumes there after lreader_fill
+int lreader_complete(lreader *r)
+{
+    char *c = r->pos + r->scan;
+    int depth = r->scan_depth;
+    int mode = r->scan_mode;
+    while (c < r->end)
+    {
+        if (mode == LSCAN_COMMENT)
+        {
+            // Comment up to the end of the line
+            if (*c == '\n' || *c == '\r')
+            {
+                mode = LSCAN_CODE;
+            }
+            c++;
+            continue;
         }
-        else if (strcmp(op, "/") == 0)
+
+        if (mode == LSCAN_STRING)
         {
-            if (y->num == 0)
+            // String up to the closing quote
+            if (*c == '\\')
             {
-                lval_del(x);
-                lval_del(y);
-                lval_del(args);
-                return lval_err("Division by zero!");
+                c++;
             }
+            else if (*c == '"')
+            {
+                mode = LSCAN_CODE;
+            }
+            c++;
+            if (mode == LSCAN_STRING)
+            {
+                continue;
+            }
+        }
+        else if (*c == ';' || *c == '"')
+        {
+            mode = *c == ';' ? LSCAN_COMMENT : LSCAN_STRING;
+            c++;
+            continue;
+        }
+        else if (*c == '(' || *c == '{' || *c == '[')
+        {
+            depth++;
+            c++;
+        }
+        else if (*c == '#' && c + 1 < r->end && c[1] == '{')
+        {
+            // Map literal
+            depth++;
+            c += 2;
+        }
+        else if (*c == ')' || *c == '}' || *c == ']')
+        {
+            depth--;
+            c++;
+        }
+        else if (isspace((unsigned char)*c))
+        {
+            c++;
+            continue;
+        }
+        else
+        {
+            // An atom is complete once something follows it
+            char *atom = c;
+            while (c < r->end && !isspace((unsigned char)*c) && !strchr("(){}[]\";", *c))
+            {
+                c++;
+            }
+            if (c >= r->end)
+            {
+                c = atom;
+                break;
+            }
+        }
 
-            x->num /= y->num;
+        if (depth <= 0)
+        {
+            r->scan = 0;
+            r->scan_depth = 0;
+            r->scan_mode = LSCAN_CODE;
+            return 1;
+        }
+    }
+
+    r->scan = c - r->pos;
+    r->scan_depth = depth;
+    r->scan_mode = mode;
+    return 0;
+}
+
+// Read the next top-level expression
+// Returns NULL at the end of the input, an error if reading fails
+lval *lreader_next(lreader *r)
+{
+    // Make sure the expression can be read without running out of input
+    while (r->fd >= 0 && !lreader_complete(r))
+    {
+        if (!lreader_fill(r))
+        {
+            break;
         }
+    }
+    if (r->error)
+    {
+        return lreader_fail(r, strerror(r->error));
+    }
+    r->scan = 0;
+    r->scan_depth = 0;
+    r->scan_mode = LSCAN_CODE;
+
+    int c = lreader_skip(r);
+    if (c == -1)
+    {
+        return NULL;
+    }
+
+    char *expected = "expression or end of input";
+    return strchr(")}]", c) ? lreader_error(r, expected)
+                            : lreader_expr(r, expected);
+}
+
+// Free the scratch space of a reader
+void lreader_free(lreader *r)
+{
+    if (r->fd >= 0)
+    {
+        free(r->start);
+    }
+    free(r->buf);
+    r->buf = NULL;
+    r->buf_size = 0;
+}
+
+// Make room for n characters in the scratch space
+char *lreader_reserve(lreader *r, long n)
+{
+    if (n > r->buf_size)
+    {
+        r->buf_size = n > 2 * r->buf_size ? n : 2 * r->buf_size;
+        r->buf = realloc(r->buf, r->buf_size);
+    }
+    return r->buf;
+}
+
+// Syntax error at the current position
+// Worded like the errors of the mpc parser this reader replaced:
+// "file:row:col: error: expected ... at ..."
+lval *lreader_error(lreader *r, char *expected)
+{
+    char found[16];
+    if (r->pos >= r->end)
+    {
+        strcpy(found, "end of input");
+    }
+    else if (*r->pos == '\n')
+    {
+        strcpy(found, "newline");
+    }
+    else
+    {
+        snprintf(found, sizeof(found), "'%c'", *r->pos);
+    }
+
+    char message[128];
+    snprintf(message, sizeof(message), "expected %s at %s", expected, found);
+    return lreader_fail(r, message);
+}
+
+// Error with a message at the current position: "file:row:col: error: ..."
+lval *lreader_fail(lreader *r, char *message)
+{
+    // Only errors pay for tracking the position
+    int row = r->row + 1;
+    int col = 1;
+    for (char *c = r->start; c < r->pos; c++)
+    {
+        if (*c == '\n')
+        {
+            row++;
+            col = 1;
+        }
+        else
+        {
+            col++;
+        }
+    }
+
+    return lval_err("%s:%i:%i: error: %s", r->filename, row, col, message);
+}
+
+// Check if c can be part of a symbol
+int lreader_is_sym(int c)
+{
+    return isalnum(c) || (c && strchr("_+-*/\\=<>!&", c));
+}
+
+// Skip whitespace and comments
+// Returns the next character, or -1 at the end of the input
+int lreader_skip(lreader *r)
+{
+    while (r->pos < r->end)
+    {
+        char c = *r->pos;
+        if (c == ';')
+        {
+            while (r->pos < r->end && *r->pos != '\n' && *r->pos != '\r')
+            {
+                r->pos++;
+            }
+        }
+        else if (isspace((unsigned char)c))
+        {
+            r->pos++;
+        }
+        else
+        {
+            return (unsigned char)c;
+        }
+    }
+    return -1;
+}
+
+// Read a number literal
+lval *lreader_num(lreader *r)
+{
+    char *begin = r->pos;
+    if (*r->pos == '-')
+    {
+        r->pos++;
+    }
+
+    // Small integers are converted while they are scanned
+    unsigned long x = 0;
+    int digits = 0;
+    while (r->pos < r->end && isdigit((unsigned char)*r->pos))
+    {
+        x = x * 10 + (*r->pos++ - '0');
+        digits++;
+    }
+
+    int is_dbl = 0;
+    if (r->pos < r->end && *r->pos == '.')
+    {
+        r->pos++;
+        if (r->pos >= r->end || !isdigit((unsigned char)*r->pos))
+        {
+            return lreader_error(r, "digit");
+        }
+        while (r->pos < r->end && isdigit((unsigned char)*r->pos))
+        {
+            r->pos++;
+        }
+        is_dbl = 1;
+    }
+    if (r->pos < r->end && (*r->pos == 'e' || *r->pos == 'E'))
+    {
+        r->pos++;
+        if (r->pos < r->end && (*r->pos == '-' || *r->pos == '+'))
+        {
+            r->pos++;
+        }
+        if (r->pos >= r->end || !isdigit((unsigned char)*r->pos))
+        {
+            return lreader_error(r, "digit");
+        }
+        while (r->pos < r->end && isdigit((unsigned char)*r->pos))
+        {
+            r->pos++;
+        }
+        is_dbl = 1;
+    }
+
+    // 18 digits always fit in a long
+    if (!is_dbl && digits <= 18)
+    {
+        return lval_num(*begin == '-' ? -(long)x : (long)x);
+    }
+
+    long len = r->pos - begin;
+    char *text = lreader_reserve(r, len + 1);
+    memcpy(text, begin, len);
+    text[len] = '\0';
+    return lval_read_num(text);
+}
+
+// Read a symbol
+lval *lreader_sym(lreader *r)
+{
+    char *begin = r->pos;
+    while (r->pos < r->end && lreader_is_sym((unsigned char)*r->pos))
+    {
+        r->pos++;
+    }
+
+    // Interned straight from the source text
+    lval *v = lval_alloc();
+    v->type = LVAL_SYM;
+    v->sym = lsym_intern_len(begin, r->pos - begin);
+    return v;
+}
+
+// Read a string literal, un-escaping it like mpcf_unescape
+lval *lreader_str(lreader *r)
+{
+    // Skip the opening quote
+    r->pos++;
+
+    // Find the closing quote
+    char *begin = r->pos;
+    long len = 0;
+    int escaped = 0;
+    while (begin + len < r->end && begin[len] != '"')
+    {
+        if (begin[len] == '\\' && begin + len + 1 < r->end)
+        {
+            escaped = 1;
+            len++;
+        }
+        len++;
+    }
+    if (begin + len >= r->end)
+    {
+        r->pos = r->end;
+        return lreader_error(r, "'\"'");
+    }
+
+    // Without escapes the string is copied straight from the source text
+    r->pos = begin + len + 1;
+    if (!escaped)
+    {
+        return lval_str_len(begin, len);
+    }
+
+    // The un-escaped string is never longer than the literal
+
+    char *text = lreader_reserve(r, len + 1);
+    char *out = text;
+    for (char *c = begin; c < begin + len; c++)
+    {
+        if (*c != '\\')
+        {
+            *out++ = *c;
+            continue;
+        }
+
+        char *escape = strchr("abfnrtv\\'\"0", c[1]);
+        if (escape && c[1])
+        {
+            *out++ = "\a\b\f\n\r\t\v\\'\"\0"[escape - "abfnrtv\\'\"0"];
+            c++;
+        }
+        else
+        {
+            // Unknown escapes are kept as they are
+            *out++ = *c;
+        }
+    }
+    *out = '\0';
+    return lval_str(text);
+}
+
+// Read the elements of a list up to the closing character into x
+lval *lreader_list(lreader *r, lval *x, char close)
+{
+    while (1)
+    {
+        int c = lreader_skip(r);
+        if (c == close)
+        {
+            r->pos++;
+            return x;
+        }
+
+        char *expected = close == ')'   ? "expression or ')'"
+                         : close == '}' ? "expression or '}'"
+                                        : "expression or ']'";
+        lval *y = c == -1 || strchr(")}]", c) ? lreader_error(r, expected)
+                                              : lreader_expr(r, expected);
+        if (y->type == LVAL_ERR)
+        {
+            lval_del(x);
+            return y;
+        }
+        lval_add(x, y);
+    }
+}
+
+// Read the keys and values of a map literal, after the '#{'
+lval *lreader_map(lreader *r)
+{
+    lval *m = lval_map();
+    while (1)
+    {
+        int c = lreader_skip(r);
+        if (c == '}')
+        {
+            r->pos++;
+            return m;
+        }
+
+        // Each key is followed by its value
+        lval *k = c == -1 || strchr(")}]", c) ? lreader_error(r, "expression or '}'")
+                                              : lreader_expr(r, "expression or '}'");
+        if (k->type == LVAL_ERR)
+        {
+            lval_del(m);
+            return k;
+        }
+
+        c = lreader_skip(r);
+        lval *x = c == -1 || strchr(")}]", c) ? lreader_error(r, "expression")
+                                              : lreader_expr(r, "expression");
+        if (x->type == LVAL_ERR)
+        {
+            lval_del(k);
+            lval_del(m);
+            return x;
+        }
+        lmap_put(m, k, x);
+    }
+}
+
+// Read the expression starting at the current (non-blank) character
+// 'expected' describes what may appear there, for the syntax error
+lval *lreader_expr(lreader *r, char *expected)
+{
+    char c = *r->pos;
+    if (c == '(' || c == '{' || c == '[' || c == '#')
+    {
+        // Lists and maps nest on the C stack
+        if (r->depth == LREADER_DEPTH_MAX)
+        {
+            return lreader_fail(r, "Maximum recursion depth exceeded!");
+        }
+        r->depth++;
+        lval *x = lreader_nested(r, expected);
+        r->depth--;
+        return x;
+    }
+    if (c == '"')
+    {
+        return lreader_str(r);
+    }
+
+    if (isdigit((unsigned char)c) ||
+        (c == '-' && r->pos + 1 < r->end && isdigit((unsigned char)r->pos[1])))
+    {
+        return lreader_num(r);
+    }
+    if (lreader_is_sym((unsigned char)c))
+    {
+        return lreader_sym(r);
+    }
+    return lreader_error(r, expected);
+}
+
+// Read the list or map literal starting at the current character
+lval *lreader_nested(lreader *r, char *expected)
+{
+    switch (*r->pos)
+    {
+    case '(':
+        r->pos++;
+        return lreader_list(r, lval_sexpr(), ')');
+    case '{':
+        r->pos++;
+        return lreader_list(r, lval_qexpr(), '}');
+    case '[':
+        r->pos++;
+        return lreader_list(r, lval_vec(), ']');
+    default:
+        if (r->pos + 1 < r->end && r->pos[1] == '{')
+        {
+            r->pos += 2;
+            return lreader_map(r);
+        }
+        return lreader_error(r, expected);
+    }
+}
+
+// Read all expressions up to the end of the input into an S-expression
+lval *lreader_all(lreader *r)
+{
+    lval *x = lval_sexpr();
+    lval *y;
+    while ((y = lreader_next(r)))
+    {
+        if (y->type == LVAL_ERR)
+        {
+            lval_del(x);
+            return y;
+        }
+        lval_add(x, y);
+    }
+    return x;
+}
+
+// Set up an output buffer for a file, or for a string when out is NULL
+void lwriter_init(lwriter *w, FILE *out)
+{
+    w->out = out;
+    w->len = 0;
+    w->capacity = out ? LWRITER_CHUNK : 64;
+    w->data = malloc(w->capacity);
+}
+
+// Release an output buffer (without flushing it)
+void lwriter_free(lwriter *w)
+{
+    free(w->data);
+    w->data = NULL;
+}
+
+// Write the buffered output to its file
+void lwriter_flush(lwriter *w)
+{
+    if (w->len > 0)
+    {
+        fwrite(w->data, 1, w->len, w->out);
+        w->len = 0;
+    }
+}
+
+// Make room for n more characters, return where they go
+// The caller adds the characters it wrote to len
+char *lwriter_reserve(lwriter *w, long n)
+{
+    if (w->len + n > w->capacity)
+    {
+        // A file gets what was buffered first, so the buffer only grows for
+        // a single piece larger than it
+        if (w->out)
+        {
+            lwriter_flush(w);
+        }
+        while (w->len + n > w->capacity)
+        {
+            w->capacity *= 2;
+        }
+        w->data = realloc(w->data, w->capacity);
+    }
+    return w->data + w->len;
+}
+
+// Append a character
+void lwriter_char(lwriter *w, char c)
+{
+    if (w->len == w->capacity)
+    {
+        lwriter_reserve(w, 1);
+    }
+    w->data[w->len++] = c;
+}
+
+// Append len characters
+void lwriter_mem(lwriter *w, char *p, long len)
+{
+    memcpy(lwriter_reserve(w, len), p, len);
+    w->len += len;
+}
+
+// Append a string
+void lwriter_str(lwriter *w, char *str)
+{
+    lwriter_mem(w, str, strlen(str));
+}
+
+// Append a number in decimal (without going through printf)
+void lwriter_long(lwriter *w, long x)
+{
+    // Digits are produced backwards into the end of a scratch buffer.
+    // The magnitude is unsigned, so LONG_MIN does not overflow.
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    unsigned long m = x < 0 ? -(unsigned long)x : (unsigned long)x;
+    do
+    {
+        *--p = (char)('0' + m % 10);
+        m /= 10;
+    } while (m);
+    if (x < 0)
+    {
+        *--p = '-';
+    }
+    lwriter_mem(w, p, digits + sizeof(digits) - p);
+}
+
+// Write the elements of an expression or a vector between brackets
+void lval_write_expr(lwriter *w, lval *v, char open, char close)
+{
+    lwriter_char(w, open);
+
+    for (int i = 0; i < v->count; i++)
+    {
+        lval_write(w, v->cell[i]);
+
+        if (i != (v->count - 1))
+        {
+            lwriter_char(w, ' ');
+        }
+    }
+
+    lwriter_char(w, close);
+}
+
+// Write the keys and values of a map in turn, between #{ and }
+void lval_write_map(lwriter *w, lval *v)
+{
+    lwriter_str(w, "#{");
+
+    int written = 0;
+    lmap_iter it;
+    lmap_iter_init(&it, v);
+    for (lval **entry; (entry = lmap_next(&it));)
+    {
+        if (written++)
+        {
+            lwriter_char(w, ' ');
+        }
+        lval_write(w, entry[0]);
+        lwriter_char(w, ' ');
+        lval_write(w, entry[1]);
+    }
+
+    lwriter_char(w, '}');
+}
+
+// Write a string between double quotes, escaped the way lreader_str
+// un-escapes it
+// Runs of characters that need no escape are copied at once
+void lval_write_str(lwriter *w, lval *v)
+{
+    lwriter_char(w, '"');
+    char *run = v->str;
+    for (char *c = v->str; *c; c++)
+    {
+        if ((unsigned char)*c >= ' ' && *c != '\\' && *c != '\'' && *c != '"')
+        {
+            continue;
+        }
+        char *escape = strchr("\a\b\f\n\r\t\v\\'\"", *c);
+        if (escape)
+        {
+            lwriter_mem(w, run, c - run);
+            lwriter_char(w, '\\');
+            lwriter_char(w, "abfnrtv\\'\""[escape - "\a\b\f\n\r\t\v\\'\""]);
+            run = c + 1;
+        }
+    }
+    lwriter_str(w, run);
+    lwriter_char(w, '"');
+}
+
+// Write a floating point number
+// Uses the shortest precision that reads back as the same value, and keeps
+// a '.' so it does not read back as an integer
+void lval_write_dbl(lwriter *w, lval *v)
+{
+    char buf[32];
+    for (int precision = 15; precision <= 17; precision++)
+    {
+        snprintf(buf, sizeof(buf), "%.*g", precision, v->dbl);
+        if (strtod(buf, NULL) == v->dbl)
+        {
+            break;
+        }
+    }
+    if (!strpbrk(buf, ".eni"))
+    {
+        strcat(buf, ".0");
+    }
+    lwriter_str(w, buf);
+}
+
+// Write a Lisp value
+void lval_write(lwriter *w, lval *v)
+{
+    switch (v->type)
+    {
+    case LVAL_NUM:
+        lwriter_long(w, v->num);
+        break;
+    case LVAL_BIG:
+    {
+        char *digits = lval_big_str(v);
+        lwriter_str(w, digits);
+        free(digits);
+        break;
+    }
+    case LVAL_DBL:
+        lval_write_dbl(w, v);
+        break;
+    case LVAL_ERR:
+        lwriter_str(w, "Error: ");
+        lwriter_str(w, v->err);
+        break;
+    case LVAL_SYM:
+        lwriter_str(w, v->sym);
+        break;
+    case LVAL_STR:
+        lval_write_str(w, v);
+        break;
+    case LVAL_SEXPR:
+        lval_write_expr(w, v, '(', ')');
+        break;
+    case LVAL_QEXPR:
+        lval_write_expr(w, v, '{', '}');
+        break;
+    case LVAL_VEC:
+        lval_write_expr(w, v, '[', ']');
+        break;
+    case LVAL_MAP:
+        lval_write_map(w, v);
+        break;
+    case LVAL_FUN:
+        if (v->builtin)
+        {
+            lwriter_str(w, "<builtin>");
+        }
+        else
+        {
+            lwriter_str(w, "(\\ ");
+            lval_write(w, v->formals);
+            lwriter_char(w, ' ');
+            lval_write(w, v->body);
+            lwriter_char(w, ')');
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Print a Lisp value
+void lval_print(lval *v)
+{
+    lwriter w;
+    lwriter_init(&w, stdout);
+    lval_write(&w, v);
+    lwriter_flush(&w);
+    lwriter_free(&w);
+}
+
+// Print a Lisp value followed by a new line
+void lval_println(lval *v)
+{
+    lwriter w;
+    lwriter_init(&w, stdout);
+    lval_write(&w, v);
+    lwriter_char(&w, '\n');
+    lwriter_flush(&w);
+    lwriter_free(&w);
+}
+
+// Function call
+lval *lval_call(lenv *e, lval *f, lval *args)
+{
+    // Overview:
+    // - If the function is builtin, just call it
+    // - Bind the arguments to the formal arguments in a new frame:
+    //   + Evaluate and return the result if fully bound
+    //   + Return a partially-evaluated function if not
+    // The function itself (formals, body, environment) is never modified,
+    // only its compiled body is cached on the first call
+
+    // Deep recursion is an error rather than a stack overflow
+    if (lstack_exhausted())
+    {
+        lval_del(args);
+        return lval_err("Maximum recursion depth exceeded!");
+    }
+
+    // Handle builtin function
+    if (f->builtin)
+    {
+        return f->builtin(e, args);
+    }
+
+    lval *result;
+    lenv *frame = lval_bind(f, args, &result);
+    if (!frame)
+    {
+        return result;
+    }
+
+    // Evaluate if all formal arguments have been bound
+    // The caller link is only followed while the call is active
+    frame->caller = e;
+    if (lvm_enabled)
+    {
+        // The compiled body is cached on the function
+        if (!f->code)
+        {
+            f->code = lcode_compile(f);
+        }
+        result = lvm_exec(frame, f->code);
+    }
+    else
+    {
+        result = lval_eval(frame, lval_body(f));
+    }
+    frame->caller = NULL;
+    lenv_del(frame);
+    return result;
+}
+
+// Check if the C stack is nearly used up
+// The stack grows down on the usual platforms, both directions are handled
+int lstack_exhausted()
+{
+    char here;
+    uintptr_t top = (uintptr_t)&here;
+    uintptr_t used = top < lstack_base ? lstack_base - top : top - lstack_base;
+    return lstack_limit && used > lstack_limit;
+}
+
+// Bind the arguments of a user-defined function in a new call frame
+// Returns the frame once every formal argument is bound. Otherwise NULL is
+// returned and *result is set to the error or the partially-evaluated
+// function. Deletes args.
+lenv *lval_bind(lval *f, lval *args, lval **result)
+{
+    // Record formal arguments and arguments count
+    lval *formals = f->formals;
+    int total = formals->count;
+    int given = args->count;
+
+    // The frame extends the environment the function closes over
+    // (including the arguments bound by earlier partial calls)
+    lenv *frame = lenv_new();
+    frame->parent = lenv_ref(f->env);
+
+    // Index of the next formal argument to bind
+    int next = 0;
+
+    for (int i = 0; i < given; i++)
+    {
+        if (next == total)
+        {
+            lenv_del(frame);
+            lval_del(args);
+            *result = lval_err("Function get passed too many arguments. Expected %i. Got %i.",
+                               total, given);
+            return NULL;
+        }
+
+        // Take the next formal argument
+        lval *sym = formals->cell[next++];
+
+        // Handle variadic function
+        if (strcmp(sym->sym, "&") == 0)
+        {
+            // Ensure & is followed by a single symbol
+            if (total - next != 1)
+            {
+                lenv_del(frame);
+                lval_del(args);
+                *result = lval_err("Invalid function format. Symbol'&' not followed by a single symbol");
+                return NULL;
+            }
+
+            // The next formal arguments should be bound to remaining arguments
+            lval *rest = lval_qexpr();
+            for (; i < given; i++)
+            {
+                rest = lval_add(rest, lval_ref(args->cell[i]));
+            }
+            lenv_bind(frame, formals->cell[next++]->sym, rest);
+            lval_del(rest);
+            break;
+        }
+
+        // Binding in the call frame
+        lenv_bind(frame, sym->sym, args->cell[i]);
+    }
+
+    // Clean up argument list after binding
+    lval_del(args);
+
+    // If '&' remains bind the next symbol to the empty list
+    if (next < total && strcmp(formals->cell[next]->sym, "&") == 0)
+    {
+        // Ensure & is followed by a single symbol
+        if (total - next != 2)
+        {
+            lenv_del(frame);
+            *result = lval_err("Invalid function format. Symbol'&' not followed by a single symbol");
+            return NULL;
+        }
+
+        // Bind empty list to the symbol after '&'
+        lval *val = lval_qexpr();
+        lenv_bind(frame, formals->cell[next + 1]->sym, val);
+        lval_del(val);
+        next += 2;
+    }
+
+    if (next == total)
+    {
+        return frame;
+    }
+
+    // Return partially-evaluated function, closing over the frame with the
+    // bound arguments, the remaining formals are shared with f
+    lval *rest = lval_qexpr();
+    for (int i = next; i < total; i++)
+    {
+        rest = lval_add(rest, lval_ref(formals->cell[i]));
+    }
+
+    *result = lval_lambda(frame, rest, lval_ref(f->body));
+    return NULL;
+}
+
+// Body of a user-defined function as an S-expression to evaluate
+lval *lval_body(lval *f)
+{
+    lval *body = lval_unshare(lval_ref(f->body));
+    body->type = LVAL_SEXPR;
+    return body;
+}
+
+// Evaluate a Lisp value
+// Expressions in tail position (the body of a function, the branch taken by
+// 'if', the expression passed to 'eval') are evaluated by the same loop
+// instead of a nested call, so tail recursion runs in constant C stack.
+// Frames of tail calls stay alive (as caller links) until the loop ends,
+// unless lookups can no longer reach them (see lenv_prune).
+lval *lval_eval(lenv *e, lval *v)
+{
+    lenv *base = e;
+    int base_evals = 0; // tail evaluations by 'eval' in base
+    lval *result;
+
+    while (1)
+    {
+        // The compiled code handles its own tail calls
+        if (lvm_enabled && v->type == LVAL_SEXPR && v->count > 1)
+        {
+            result = lvm_eval(e, v);
+            break;
+        }
+
+        // Variable resolution
+        if (v->type == LVAL_SYM)
+        {
+            result = lenv_get(e, v);
+            lval_del(v);
+            break;
+        }
+
+        // Other types than S-expression (and empty expression) remain the same
+        if (v->type != LVAL_SEXPR || v->count == 0)
+        {
+            result = v;
+            break;
+        }
+
+        // Single expression evaluates to its element (in tail position)
+        if (v->count == 1)
+        {
+            lval *x = lval_ref(v->cell[0]);
+            lval_del(v);
+            v = x;
+            continue;
+        }
+
+        // Evaluating the children nests on the C stack: deep recursion is
+        // an error rather than a stack overflow (see lval_call)
+        if (lstack_exhausted())
+        {
+            lval_del(v);
+            result = lval_err("Maximum recursion depth exceeded!");
+            break;
+        }
+
+        // Children are replaced in place
+        v = lval_unshare(v);
+        lval_own(v);
+
+        // Evaluate children
+        // The last argument of 'do' is left to the loop (tail position)
+        int failed = -1;
+        int count = v->count;
+        for (int i = 0; i < count; i++)
+        {
+            v->cell[i] = lval_eval(e, v->cell[i]);
+
+            // Error checking
+            if (v->cell[i]->type == LVAL_ERR)
+            {
+                failed = i;
+                break;
+            }
+            if (i == 0 && v->cell[0]->type == LVAL_FUN && v->cell[0]->builtin == builtin_do)
+            {
+                count--;
+            }
+        }
+        if (failed >= 0)
+        {
+            result = lval_take(v, failed);
+            break;
+        }
+        if (count < v->count)
+        {
+            v = lval_take(v, count);
+            continue;
+        }
+
+        // Ensure the first element (after evaluation) is a function
+        lval *f = lval_pop(v, 0);
+        if (f->type != LVAL_FUN)
+        {
+            result = lval_err("S-expression must start with a function! Got %s",
+                              ltype_name(f->type));
+            lval_del(f);
+            lval_del(v);
+            break;
+        }
+
+        // Tail positions: continue with the expression to evaluate
+        if (f->builtin == builtin_if || f->builtin == builtin_eval)
+        {
+            int eval = f->builtin == builtin_eval;
+            v = eval ? lval_eval_expr(v) : lval_if_branch(v);
+            lval_del(f);
+            if (v->type == LVAL_ERR)
+            {
+                result = v;
+                break;
+            }
+
+            // The rest of the code running in e comes from 'eval' (the
+            // mark stays on the frames of tail calls, which end with it)
+            if (eval)
+            {
+                e->evals++;
+                base_evals += e == base;
+            }
+            continue;
+        }
+
+        // Call function to get result
+        if (f->builtin)
+        {
+            result = f->builtin(e, v);
+            lval_del(f);
+            break;
+        }
+
+        // Tail call: continue with the body in the new frame
+        lenv *frame = lval_bind(f, v, &result);
+        if (!frame)
+        {
+            lval_del(f);
+            break;
+        }
+        frame->caller = e;
+        lenv_prune(frame, base);
+        e = frame;
+        v = lval_body(f);
+        lval_del(f);
+    }
+
+    // Release the frames of tail calls
+    lenv_unwind(e, base);
+    base->evals -= base_evals;
+    return result;
+}
+
+// Bytecode compiler and virtual machine (enabled with --vm)
+
+// Create an empty code object
+lcode *lcode_new()
+{
+    lcode *c = malloc(sizeof(lcode));
+    c->refs = 1;
+    c->count = 0;
+    c->capacity = 0;
+    c->ops = NULL;
+    c->const_count = 0;
+    c->const_capacity = 0;
+    c->consts = NULL;
+    c->depth = 0;
+    c->max_depth = 0;
+    c->frame_size = -1;
+    return c;
+}
+
+// Delete a code object (drop a reference, free with the last one)
+void lcode_del(lcode *c)
+{
+    if (--c->refs > 0)
+    {
+        return;
+    }
+
+    for (int i = 0; i < c->const_count; i++)
+    {
+        lval_del(c->consts[i]);
+    }
+    free(c->consts);
+    free(c->ops);
+    free(c);
+}
+
+// Append an instruction word, return its position
+int lcode_emit(lcode *c, int word)
+{
+    if (c->count == c->capacity)
+    {
+        c->capacity = c->capacity ? c->capacity * 2 : 16;
+        c->ops = realloc(c->ops, sizeof(int) * c->capacity);
+    }
+    c->ops[c->count] = word;
+    return c->count++;
+}
+
+// Add a constant (taking a reference to it), return its index
+int lcode_const(lcode *c, lval *v)
+{
+    if (c->const_count == c->const_capacity)
+    {
+        c->const_capacity = c->const_capacity ? c->const_capacity * 2 : 8;
+        c->consts = realloc(c->consts, sizeof(lval *) * c->const_capacity);
+    }
+    c->consts[c->const_count] = lval_ref(v);
+    return c->const_count++;
+}
+
+// Track the number of values on the stack while compiling
+void lcode_push(lcode *c, int n)
+{
+    c->depth += n;
+    if (c->depth > c->max_depth)
+    {
+        c->max_depth = c->depth;
+    }
+}
+
+// Frame slot of a formal argument, -1 if sym is not one
+// Arguments are bound in order of the formals, skipping '&'
+int lcode_slot(lval *formals, char *sym)
+{
+    if (!formals)
+    {
+        return -1;
+    }
+
+    int slot = 0;
+    for (int i = 0; i < formals->count; i++)
+    {
+        if (strcmp(formals->cell[i]->sym, "&") == 0)
+        {
+            continue;
+        }
+        if (formals->cell[i]->sym == sym)
+        {
+            return slot;
+        }
+        slot++;
+    }
+    return -1;
+}
+
+// Compile code evaluating v
+// tail: the value of v is returned, so a call can replace the current one
+void lcode_compile_expr(lcode *c, lval *formals, lval *v, int tail)
+{
+    switch (v->type)
+    {
+    case LVAL_SYM:
+    {
+        // Formals live in the call frame, other symbols are looked up
+        int slot = lcode_slot(formals, v->sym);
+        if (slot >= 0)
+        {
+            lcode_emit(c, LOP_LOCAL);
+            lcode_emit(c, slot);
+        }
+        else
+        {
+            lcode_emit(c, LOP_LOOKUP);
+        }
+        lcode_emit(c, lcode_const(c, v));
+        if (slot < 0)
+        {
+            // Empty cache
+            lcode_emit(c, 0);
+            lcode_emit(c, 0);
+            lcode_emit(c, 0);
+        }
+        lcode_push(c, 1);
+        break;
+    }
+    case LVAL_SEXPR:
+        lcode_compile_sexpr(c, formals, v, tail);
+        break;
+    default:
+        // Other values evaluate to themselves
+        lcode_emit(c, LOP_CONST);
+        lcode_emit(c, lcode_const(c, v));
+        lcode_push(c, 1);
+        break;
+    }
+}
+
+// Compile code evaluating the elements of v as an S-expression
+void lcode_compile_sexpr(lcode *c, lval *formals, lval *v, int tail)
+{
+    // Empty expression evaluates to itself
+    if (v->count == 0)
+    {
+        lval *empty = lval_sexpr();
+        lcode_emit(c, LOP_CONST);
+        lcode_emit(c, lcode_const(c, empty));
+        lcode_push(c, 1);
+        lval_del(empty);
+        return;
+    }
+
+    // Single expression evaluates to its element
+    if (v->count == 1)
+    {
+        lcode_compile_expr(c, formals, v->cell[0], tail);
+        return;
+    }
+
+    // (if cond {then} {else}) branches inline while 'if' is the builtin
+    if (v->count == 4 && v->cell[0]->type == LVAL_SYM &&
+        strcmp(v->cell[0]->sym, "if") == 0 &&
+        v->cell[2]->type == LVAL_QEXPR && v->cell[3]->type == LVAL_QEXPR)
+    {
+        lcode_compile_expr(c, formals, v->cell[0], 0);
+
+        // Pops 'if' when it is the builtin, otherwise jumps to the call
+        lcode_emit(c, LOP_IF);
+        int to_call = lcode_emit(c, 0);
+        c->depth--;
+
+        // Picks a branch, else-branch constant follows the then-branch one
+        lcode_compile_expr(c, formals, v->cell[1], 0);
+        lcode_emit(c, LOP_BRANCH);
+        int to_else = lcode_emit(c, 0);
+        lcode_emit(c, lcode_const(c, v->cell[2]));
+        lcode_const(c, v->cell[3]);
+        c->depth--;
+
+        lcode_compile_sexpr(c, formals, v->cell[2], tail);
+        lcode_emit(c, LOP_JUMP);
+        int then_end = lcode_emit(c, 0);
+        c->depth--;
+
+        c->ops[to_else] = c->count;
+        lcode_compile_sexpr(c, formals, v->cell[3], tail);
+        lcode_emit(c, LOP_JUMP);
+        int else_end = lcode_emit(c, 0);
+        c->depth--;
+
+        // Regular call when 'if' has been redefined
+        c->ops[to_call] = c->count;
+        c->depth++;
+        for (int i = 1; i < v->count; i++)
+        {
+            lcode_compile_expr(c, formals, v->cell[i], 0);
+        }
+        lcode_emit(c, tail ? LOP_TAIL : LOP_CALL);
+        lcode_emit(c, v->count);
+        c->depth -= v->count - 1;
+
+        c->ops[then_end] = c->count;
+        c->ops[else_end] = c->count;
+        return;
+    }
+
+    // (do ...) evaluates its last argument in tail position while 'do' is
+    // the builtin
+    if (v->cell[0]->type == LVAL_SYM && strcmp(v->cell[0]->sym, "do") == 0)
+    {
+        lcode_compile_expr(c, formals, v->cell[0], 0);
+
+        // Pops 'do' when it is the builtin, otherwise jumps to the call
+        lcode_emit(c, LOP_DO);
+        int to_call = lcode_emit(c, 0);
+        c->depth--;
+
+        for (int i = 1; i < v->count - 1; i++)
+        {
+            lcode_compile_expr(c, formals, v->cell[i], 0);
+            lcode_emit(c, LOP_POP);
+            c->depth--;
+        }
+        lcode_compile_expr(c, formals, v->cell[v->count - 1], tail);
+        lcode_emit(c, LOP_JUMP);
+        int do_end = lcode_emit(c, 0);
+        c->depth--;
+
+        // Regular call when 'do' has been redefined
+        c->ops[to_call] = c->count;
+        c->depth++;
+        for (int i = 1; i < v->count; i++)
+        {
+            lcode_compile_expr(c, formals, v->cell[i], 0);
+        }
+        lcode_emit(c, tail ? LOP_TAIL : LOP_CALL);
+        lcode_emit(c, v->count);
+        c->depth -= v->count - 1;
+
+        c->ops[do_end] = c->count;
+        return;
+    }
+
+    // Function call: evaluate all elements, then call the first one
+    for (int i = 0; i < v->count; i++)
+    {
+        lcode_compile_expr(c, formals, v->cell[i], 0);
+    }
+    lcode_emit(c, tail ? LOP_TAIL : LOP_CALL);
+    lcode_emit(c, v->count);
+    c->depth -= v->count - 1;
+}
+
+// Compile the body of a user-defined function
+lcode *lcode_compile(lval *f)
+{
+    lcode *c = lcode_new();
+    lcode_compile_sexpr(c, f->formals, f->body, 1);
+
+    // Formals bound in a new frame ('&' excluded, repeated symbols once)
+    c->frame_size = 0;
+    for (int i = 0; i < f->formals->count; i++)
+    {
+        char *sym = f->formals->cell[i]->sym;
+        int repeated = strcmp(sym, "&") == 0;
+        for (int j = 0; j < i && !repeated; j++)
+        {
+            repeated = f->formals->cell[j]->sym == sym;
+        }
+        c->frame_size += !repeated;
+    }
+    lcode_emit(c, LOP_RETURN);
+    return c;
+}
+
+// Run compiled code in environment e
+// A call in tail position continues with the code of the callee in the same
+// loop. Its frame is released when the code returns (unless lenv_prune
+// releases it earlier), like the tail calls of lval_eval.
+lval *lvm_exec(lenv *e, lcode *c)
+{
+    lenv *base = e;
+    int base_evals = 0; // tail evaluations by 'eval' in base
+    lcode *held = NULL; // code switched to by a tail call
+    int *ops = c->ops;
+    lval **consts = c->consts;
+    int frame_size = c->frame_size;
+    // The value stack lives on the heap, so that a nested call only adds
+    // this frame to the C stack (no deeper recursion than lval_eval)
+    int stack_size = c->max_depth > 0 ? c->max_depth : 1;
+    lval **stack = malloc(sizeof(lval *) * stack_size);
+    int sp = 0;
+    int pc = 0;
+    lval *x;
+
+#if defined(__GNUC__)
+    // Jump straight to the next instruction's handler
+    static void *handlers[] = {
+        [LOP_CONST] = &&op_const,
+        [LOP_LOCAL] = &&op_local,
+        [LOP_LOOKUP] = &&op_lookup,
+        [LOP_CALL] = &&op_call,
+        [LOP_TAIL] = &&op_tail,
+        [LOP_IF] = &&op_if,
+        [LOP_DO] = &&op_do,
+        [LOP_POP] = &&op_pop,
+        [LOP_BRANCH] = &&op_branch,
+        [LOP_JUMP] = &&op_jump,
+        [LOP_RETURN] = &&op_return,
+    };
+#define LVM_CASE(op, label) label:
+#define LVM_NEXT goto *handlers[ops[pc++]]
+    LVM_NEXT;
+#else
+    // Portable fallback: one switch per instruction
+#define LVM_CASE(op, label) case op:
+#define LVM_NEXT goto dispatch
+dispatch:
+    switch (ops[pc++])
+    {
+#endif
+
+    LVM_CASE(LOP_CONST, op_const)
+    {
+        stack[sp++] = lval_ref(consts[ops[pc++]]);
+        LVM_NEXT;
+    }
+
+    LVM_CASE(LOP_LOCAL, op_local)
+    {
+        // Frame slot, the symbol is looked up if the frame differs
+        // (e.g. the formals repeat a symbol)
+        int slot = ops[pc++];
+        lval *sym = consts[ops[pc++]];
+        if (slot < e->count && e->syms[slot] == sym->sym)
+        {
+            stack[sp++] = lval_ref(e->vals[slot]);
+            LVM_NEXT;
+        }
+        x = lenv_get(e, sym);
+        goto push_checked;
+    }
+
+    LVM_CASE(LOP_LOOKUP, op_lookup)
+    {
+        lval *sym = consts[ops[pc]];
+        int *cache = &ops[pc + 1];
+        pc += 4;
+
+        // Position found by an earlier lookup from this instruction
+        // The frames of a function always have the same lexical chain, and
+        // the same bindings until '=' adds one (the frame is then checked
+        // first)
+        // Code from 'eval' looks through the callers first (see lenv_get)
+        if (e->evals)
+        {
+            x = lenv_get(e, sym);
+            goto push_checked;
+        }
+
+        int fresh = e->count == frame_size;
+        if (cache[0] == lenv_epoch && (cache[1] == 0 || fresh))
+        {
+            lenv *scope = e;
+            for (int depth = cache[1]; depth > 0 && scope; depth--)
+            {
+                scope = scope->parent;
+            }
+            if (scope && cache[2] < scope->count && scope->syms[cache[2]] == sym->sym)
+            {
+                stack[sp++] = lval_ref(scope->vals[cache[2]]);
+                LVM_NEXT;
+            }
+        }
+
+        // Symbols bound lexically are cached, the others are looked up
+        // through the callers each time
+        int depth;
+        lenv *scope = lenv_locate(e, sym->sym, &depth);
+        if (scope)
+        {
+            int slot = lenv_find(scope, sym->sym);
+            if (depth == 0 || fresh)
+            {
+                cache[0] = lenv_epoch;
+                cache[1] = depth;
+                cache[2] = slot;
+            }
+            stack[sp++] = lval_ref(scope->vals[slot]);
+            LVM_NEXT;
+        }
+        x = lenv_get(e, sym);
+        goto push_checked;
+    }
+
+    LVM_CASE(LOP_CALL, op_call)
+    LVM_CASE(LOP_TAIL, op_tail)
+    {
+        // The function and its arguments are on top of the stack
+        int tail = ops[pc - 1] == LOP_TAIL;
+        int n = ops[pc++];
+        sp -= n;
+        lval *f = stack[sp];
+        if (f->type != LVAL_FUN)
+        {
+            x = lval_err("S-expression must start with a function! Got %s",
+                         ltype_name(f->type));
+            for (int i = 0; i < n; i++)
+            {
+                lval_del(stack[sp + i]);
+            }
+            goto error;
+        }
+
+        // Two numbers given to an arithmetic or comparison builtin
+        if (n == 3 && f->builtin &&
+            (x = lval_op2(f->builtin, stack[sp + 1], stack[sp + 2])))
+        {
+            lval_del(f);
+            stack[sp++] = x;
+            LVM_NEXT;
+        }
+
+        lval *args = lval_sexpr();
+        lval_reserve(args, n - 1);
+        for (int i = 1; i < n; i++)
+        {
+            lval_add(args, stack[sp + i]);
+        }
+
+        int tail_builtin = f->builtin == builtin_if || f->builtin == builtin_eval;
+        if (!tail || (f->builtin && !tail_builtin))
+        {
+            x = lval_call(e, f, args);
+            lval_del(f);
+            goto push_checked;
+        }
+
+        // Code to continue with
+        lcode *next;
+        if (tail_builtin)
+        {
+            // Compile the expression 'if' or 'eval' would evaluate
+            int is_eval = f->builtin == builtin_eval;
+            lval *v = is_eval ? lval_eval_expr(args) : lval_if_branch(args);
+            lval_del(f);
+            if (v->type == LVAL_ERR)
+            {
+                x = v;
+                goto error;
+            }
+            next = lcode_new();
+            lcode_compile_expr(next, NULL, v, 1);
+            lcode_emit(next, LOP_RETURN);
+            lval_del(v);
+
+            // The rest of the code running in e comes from 'eval' (see
+            // lval_eval)
+            if (is_eval)
+            {
+                e->evals++;
+                base_evals += e == base;
+            }
+        }
+        else
+        {
+            // Bind the arguments, a partial call is the result
+            lenv *frame = lval_bind(f, args, &x);
+            if (!frame)
+            {
+                lval_del(f);
+                goto push_checked;
+            }
+            frame->caller = e;
+            lenv_prune(frame, base);
+            e = frame;
+
+            if (!f->code)
+            {
+                f->code = lcode_compile(f);
+            }
+            next = f->code;
+            next->refs++;
+            lval_del(f);
+        }
+
+        if (held)
+        {
+            lcode_del(held);
+        }
+        held = next;
+
+        if (next->max_depth > stack_size)
+        {
+            stack_size = next->max_depth;
+            stack = realloc(stack, sizeof(lval *) * stack_size);
+        }
+
+        ops = next->ops;
+        consts = next->consts;
+        frame_size = next->frame_size;
+        pc = 0;
+        LVM_NEXT;
+    }
+
+    LVM_CASE(LOP_IF, op_if)
+    {
+        // Inline branches only while 'if' is the builtin
+        int target = ops[pc++];
+        lval *f = stack[sp - 1];
+        if (f->type == LVAL_FUN && f->builtin == builtin_if)
+        {
+            lval_del(f);
+            sp--;
+        }
+        else
+        {
+            pc = target;
+        }
+        LVM_NEXT;
+    }
+
+    LVM_CASE(LOP_DO, op_do)
+    {
+        // Inline the arguments only while 'do' is the builtin
+        int target = ops[pc++];
+        lval *f = stack[sp - 1];
+        if (f->type == LVAL_FUN && f->builtin == builtin_do)
+        {
+            lval_del(f);
+            sp--;
+        }
+        else
+        {
+            pc = target;
+        }
+        LVM_NEXT;
+    }
+
+    LVM_CASE(LOP_POP, op_pop)
+    {
+        lval_del(stack[--sp]);
+        LVM_NEXT;
+    }
+
+    LVM_CASE(LOP_BRANCH, op_branch)
+    {
+        int target = ops[pc++];
+        int branches = ops[pc++];
+        lval *cond = stack[--sp];
+        if (!lval_is_number(cond))
+        {
+            // Let the builtin report the error
+            lval *args = lval_add(lval_sexpr(), cond);
+            args = lval_add(args, lval_ref(consts[branches]));
+            args = lval_add(args, lval_ref(consts[branches + 1]));
+            x = builtin_if(e, args);
+            goto error;
+        }
+        if ((cond->type == LVAL_NUM && !cond->num) ||
+            (cond->type == LVAL_DBL && !cond->dbl))
+        {
+            pc = target;
+        }
+        lval_del(cond);
+        LVM_NEXT;
+    }
+
+    LVM_CASE(LOP_JUMP, op_jump)
+    {
+        pc = ops[pc];
+        LVM_NEXT;
+    }
+
+    LVM_CASE(LOP_RETURN, op_return)
+    {
+        x = stack[--sp];
+        goto done;
+    }
+
+#if !defined(__GNUC__)
+    }
+#endif
+
+push_checked:
+    // Errors abort the evaluation of the whole expression
+    if (x->type == LVAL_ERR)
+    {
+        goto error;
+    }
+    stack[sp++] = x;
+    LVM_NEXT;
+
+error:
+    while (sp > 0)
+    {
+        lval_del(stack[--sp]);
+    }
+
+done:
+    // Release the frames and code of tail calls
+    lenv_unwind(e, base);
+    base->evals -= base_evals;
+    if (held)
+    {
+        lcode_del(held);
+    }
+    free(stack);
+    return x;
+
+#undef LVM_CASE
+#undef LVM_NEXT
+}
+
+// Compile and run a top-level expression
+lval *lvm_eval(lenv *e, lval *v)
+{
+    lcode *c = lcode_new();
+    lcode_compile_expr(c, NULL, v, 1);
+    lcode_emit(c, LOP_RETURN);
+    lval_del(v);
+
+    lval *x = lvm_exec(e, c);
+    lcode_del(c);
+    return x;
+}
+
+// Pop the element at index i from an S-expression (not shared)
+lval *lval_pop(lval *v, int i)
+{
+    // Find the item at index i
+    lval *x = v->cell[i];
+
+    if (i == 0)
+    {
+        // Popping the first item only moves the start of the list. The
+        // reference moves out of the buffer, unless other lists can see
+        // the slot.
+        lcells *b = v->buf;
+        if (b->refs == 1 && v->cell == b->slots + b->lo)
+        {
+            b->lo++;
+        }
+        else
+        {
+            lval_ref(x);
+        }
+        v->cell++;
+    }
+    else
+    {
+        // Shift memory after the item at 'i' backward
+        lval_own(v);
+        memmove(
+            &v->cell[i],                        // destination start
+            &v->cell[i + 1],                    // source start
+            sizeof(lval *) * (v->count - 1 - i) // number of bytes to move
+        );
+        v->buf->hi--;
+    }
+
+    // Decrease the item count, the memory is kept for later additions
+    v->count--;
+    if (v->count == 0)
+    {
+        lval_own(v);
+    }
+
+    // Return the popped element
+    return x;
+}
+
+// Similar to lval_pop, but also delete the original value
+lval *lval_take(lval *v, int i)
+{
+    lval *x = lval_pop(v, i);
+    lval_del(v);
+    return x;
+}
+
+// Create a copy of v
+// Elements, formals, body and environment are shared with v
+lval *lval_copy(lval *v)
+{
+    lval *x = lval_alloc();
+    x->type = v->type;
+
+    switch (v->type)
+    {
+    // Copy number directly
+    case LVAL_NUM:
+        x->num = v->num;
+        break;
+    case LVAL_DBL:
+        x->dbl = v->dbl;
+        break;
+    case LVAL_BIG:
+        x->neg = v->neg;
+        x->nlimbs = v->nlimbs;
+        x->limbs = malloc(sizeof(uint32_t) * v->nlimbs);
+        memcpy(x->limbs, v->limbs, sizeof(uint32_t) * v->nlimbs);
+        break;
+
+    case LVAL_FUN:
+        if (v->builtin)
+        {
+            // Copy function pointer directly
+            x->builtin = v->builtin;
+        }
+        else
+        {
+            // Handle user-defined function
+            x->builtin = NULL;
+            x->env = lenv_ref(v->env);
+            x->formals = lval_ref(v->formals);
+            x->body = lval_ref(v->body);
+            x->code = v->code;
+            if (x->code)
+            {
+                x->code->refs++;
+            }
+        }
+        break;
+
+    // Copy string for error, symbol, string
+    case LVAL_ERR:
+        x->err = malloc(strlen(v->err) + 1);
+        strcpy(x->err, v->err);
+        break;
+    case LVAL_SYM:
+        x->sym = v->sym;
+        break;
+    case LVAL_STR:
+        x->str = malloc(strlen(v->str) + 1);
+        strcpy(x->str, v->str);
+        break;
+
+    // Copy List by sharing the cell buffer
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_VEC:
+        x->count = v->count;
+        x->cell = v->cell;
+        x->buf = v->buf;
+        if (x->buf)
+        {
+            x->buf->refs++;
+        }
+        break;
+
+    // Copy the node, sharing the keys, values and nodes below
+    case LVAL_MAP:
+    {
+        int n = lmap_nslots(v);
+        x->nentries = v->nentries;
+        x->datamap = v->datamap;
+        x->nodemap = v->nodemap;
+        x->slots = n ? malloc(sizeof(lval *) * n) : NULL;
+        for (int i = 0; i < n; i++)
+        {
+            x->slots[i] = lval_ref(v->slots[i]);
+        }
+        break;
+    }
+    }
+
+    return x;
+}
+
+// Add a reference to v
+lval *lval_ref(lval *v)
+{
+    v->refs++;
+    return v;
+}
+
+// Return a version of v that can be modified
+// Takes over the caller's reference: v itself if it is not shared,
+// otherwise a copy (and the reference to v is dropped)
+// A list copy shares the cell buffer: see lval_own before replacing or
+// moving its elements
+lval *lval_unshare(lval *v)
+{
+    if (v->refs == 1)
+    {
+        return v;
+    }
+
+    lval *x = lval_copy(v);
+    lval_del(v);
+    return x;
+}
+
+// Give a list (not shared) a cell buffer of its own, so its elements can
+// be replaced or moved: the elements are copied out of a buffer other lists
+// share, otherwise the references the buffer holds outside the list are
+// dropped
+void lval_own(lval *v)
+{
+    lcells *b = v->buf;
+    if (!b)
+    {
+        return;
+    }
+
+    if (b->refs > 1)
+    {
+        int count = v->count;
+        if (!count)
+        {
+            lcells_release(b);
+            v->cell = NULL;
+            v->buf = NULL;
+            return;
+        }
+        lcells *x = lcells_alloc(lcells_capacity(count));
+        lval_move_cells(v, x->slots);
+        x->hi = count;
+        v->count = count;
+        v->cell = x->slots;
+        v->buf = x;
+        return;
+    }
+
+    int start = v->cell - b->slots;
+    int end = start + v->count;
+    for (int i = b->lo; i < start; i++)
+    {
+        lval_del(b->slots[i]);
+    }
+    for (int i = end; i < b->hi; i++)
+    {
+        lval_del(b->slots[i]);
+    }
+
+    // An empty list starts over at the beginning of the buffer
+    if (!v->count)
+    {
+        start = end = 0;
+        v->cell = b->slots;
+    }
+    b->lo = start;
+    b->hi = end;
+}
+
+// List of the elements of v from index start up to (not including) end
+// Takes over the reference to v. The result is a view of the cell buffer
+// of v, so no element is copied.
+lval *lval_slice(lval *v, int start, int end)
+{
+    v = lval_unshare(v);
+    v->count = end - start;
+    if (v->count)
+    {
+        v->cell += start;
+    }
+    else
+    {
+        lval_own(v);
+    }
+    return v;
+}
+
+// Check if the elements items can be stored in the free slots of the cell
+// buffer of v
+// A list or a map stored in a buffer other lists see could be (or hold) a
+// view of that buffer: a cycle without an environment, which the collector
+// never scans. Such elements only go into a buffer v is alone to see.
+int lcells_can_take(lval *v, lval **items, int n)
+{
+    if (v->refs == 1 && v->buf->refs == 1)
+    {
+        return 1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        int type = items[i]->type;
+        if (type == LVAL_SEXPR || type == LVAL_QEXPR || type == LVAL_VEC || type == LVAL_MAP)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Move the elements of a list (not shared) to dst, which then holds their
+// references, leaving the list empty without a buffer
+void lval_move_cells(lval *v, lval **dst)
+{
+    lcells *b = v->buf;
+    if (!b)
+    {
+        return;
+    }
+
+    memcpy(dst, v->cell, sizeof(lval *) * v->count);
+    if (b->refs == 1 && v->cell == b->slots + b->lo && v->cell + v->count == b->slots + b->hi)
+    {
+        // The references move out of the buffer
+        b->hi = b->lo;
+    }
+    else
+    {
+        for (int i = 0; i < v->count; i++)
+        {
+            lval_ref(dst[i]);
+        }
+    }
+    lcells_release(b);
+
+    v->count = 0;
+    v->cell = NULL;
+    v->buf = NULL;
+}
+
+// Return string representation of a type
+char *ltype_name(int t)
+{
+    switch (t)
+    {
+    case LVAL_FUN:
+        return "Function";
+    case LVAL_NUM:
+        return "Number";
+    case LVAL_BIG:
+        return "Bignum";
+    case LVAL_DBL:
+        return "Float";
+    case LVAL_ERR:
+        return "Error";
+    case LVAL_SYM:
+        return "Symbol";
+    case LVAL_STR:
+        return "String";
+    case LVAL_SEXPR:
+        return "S-Expression";
+    case LVAL_QEXPR:
+        return "Q-Expression";
+    case LVAL_VEC:
+        return "Vector";
+    case LVAL_MAP:
+        return "Map";
+    default:
+        return "Unknown";
+    }
+}
+
+// Bignum with the value of a number
+lval *lval_big_from(long x)
+{
+    uint64_t m = x < 0 ? -(uint64_t)x : (uint64_t)x;
+    lval *v = lval_big(x < 0, 2);
+    v->limbs[0] = (uint32_t)m;
+    v->limbs[1] = (uint32_t)(m >> 32);
+    return v;
+}
+
+// Number or bignum as a bignum (a new reference)
+lval *lval_to_big(lval *x)
+{
+    return x->type == LVAL_BIG ? lval_ref(x) : lval_big_from(x->num);
+}
+
+// Drop the leading zero limbs and turn the bignum into a number if it fits
+// Takes over the reference to v
+lval *lval_big_norm(lval *v)
+{
+    while (v->nlimbs > 0 && v->limbs[v->nlimbs - 1] == 0)
+    {
+        v->nlimbs--;
+    }
+    if (v->nlimbs > 2)
+    {
+        return v;
+    }
+
+    uint64_t m = 0;
+    for (int i = v->nlimbs - 1; i >= 0; i--)
+    {
+        m = (m << 32) | v->limbs[i];
+    }
+
+    // -LONG_MIN itself does not fit, so compare against LONG_MAX + 1
+    if (m > (uint64_t)LONG_MAX + v->neg)
+    {
+        return v;
+    }
+    long x = m == 0 ? 0 : v->neg ? -(long)(m - 1) - 1 : (long)m;
+    lval_del(v);
+    return lval_num(x);
+}
+
+// Compare magnitudes, ignoring leading zero limbs
+int lbig_cmp_mag(lval *a, lval *b)
+{
+    int na = a->nlimbs;
+    int nb = b->nlimbs;
+    while (na > 0 && a->limbs[na - 1] == 0)
+    {
+        na--;
+    }
+    while (nb > 0 && b->limbs[nb - 1] == 0)
+    {
+        nb--;
+    }
+    if (na != nb)
+    {
+        return na > nb ? 1 : -1;
+    }
+
+    for (int i = na - 1; i >= 0; i--)
+    {
+        if (a->limbs[i] != b->limbs[i])
+        {
+            return a->limbs[i] > b->limbs[i] ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+// Sum of magnitudes, with the given sign
+lval *lbig_add_mag(lval *a, lval *b, int neg)
+{
+    if (a->nlimbs < b->nlimbs)
+    {
+        lval *t = a;
+        a = b;
+        b = t;
+    }
+
+    lval *r = lval_big(neg, a->nlimbs + 1);
+    uint64_t carry = 0;
+    for (int i = 0; i < a->nlimbs; i++)
+    {
+        carry += a->limbs[i];
+        if (i < b->nlimbs)
+        {
+            carry += b->limbs[i];
+        }
+        r->limbs[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    r->limbs[a->nlimbs] = (uint32_t)carry;
+    return r;
+}
+
+// Difference of magnitudes |a| - |b| (|a| >= |b|), with the given sign
+lval *lbig_sub_mag(lval *a, lval *b, int neg)
+{
+    lval *r = lval_big(neg, a->nlimbs);
+    int64_t borrow = 0;
+    for (int i = 0; i < a->nlimbs; i++)
+    {
+        int64_t t = (int64_t)a->limbs[i] - borrow;
+        if (i < b->nlimbs)
+        {
+            t -= b->limbs[i];
+        }
+        borrow = t < 0;
+        r->limbs[i] = (uint32_t)(t + (borrow << 32));
+    }
+    return r;
+}
+
+// Sum a + b, or the difference a - b when sub is set
+lval *lval_big_add(lval *a, lval *b, int sub)
+{
+    int bneg = b->neg ^ sub;
+    if (a->neg == bneg)
+    {
+        return lbig_add_mag(a, b, a->neg);
+    }
+
+    // Signs differ: subtract the smaller magnitude from the larger one
+    if (lbig_cmp_mag(a, b) >= 0)
+    {
+        return lbig_sub_mag(a, b, a->neg);
+    }
+    return lbig_sub_mag(b, a, bneg);
+}
+
+// Product (schoolbook multiplication)
+lval *lval_big_mul(lval *a, lval *b)
+{
+    lval *r = lval_big(a->neg ^ b->neg, a->nlimbs + b->nlimbs);
+    for (int i = 0; i < a->nlimbs; i++)
+    {
+        uint64_t carry = 0;
+        for (int j = 0; j < b->nlimbs; j++)
+        {
+            carry += (uint64_t)a->limbs[i] * b->limbs[j] + r->limbs[i + j];
+            r->limbs[i + j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        r->limbs[i + b->nlimbs] = (uint32_t)carry;
+    }
+    return r;
+}
+
+// Quotient truncated toward zero, like the division of numbers
+// Long division by Knuth's algorithm D (TAOCP vol. 2, 4.3.1)
+lval *lval_big_div(lval *a, lval *b)
+{
+    // Significant limbs
+    int m = a->nlimbs;
+    int n = b->nlimbs;
+    while (m > 0 && a->limbs[m - 1] == 0)
+    {
+        m--;
+    }
+    while (n > 0 && b->limbs[n - 1] == 0)
+    {
+        n--;
+    }
+
+    int neg = a->neg ^ b->neg;
+    if (m < n || lbig_cmp_mag(a, b) < 0)
+    {
+        return lval_big(neg, 0);
+    }
+
+    lval *q = lval_big(neg, m - n + 1);
+    if (n == 1)
+    {
+        // Single limb divisor
+        uint64_t rem = 0;
+        for (int i = m - 1; i >= 0; i--)
+        {
+            uint64_t cur = (rem << 32) | a->limbs[i];
+            q->limbs[i] = (uint32_t)(cur / b->limbs[0]);
+            rem = cur % b->limbs[0];
+        }
+        return q;
+    }
+
+    // Normalize so the top limb of the divisor has its high bit set
+    int shift = __builtin_clz(b->limbs[n - 1]);
+    uint32_t *vn = malloc(sizeof(uint32_t) * n);
+    uint32_t *un = malloc(sizeof(uint32_t) * (m + 1));
+    for (int i = n - 1; i > 0; i--)
+    {
+        vn[i] = (b->limbs[i] << shift) |
+                (shift ? b->limbs[i - 1] >> (32 - shift) : 0);
+    }
+    vn[0] = b->limbs[0] << shift;
+    un[m] = shift ? a->limbs[m - 1] >> (32 - shift) : 0;
+    for (int i = m - 1; i > 0; i--)
+    {
+        un[i] = (a->limbs[i] << shift) |
+                (shift ? a->limbs[i - 1] >> (32 - shift) : 0);
+    }
+    un[0] = a->limbs[0] << shift;
+
+    const uint64_t base = (uint64_t)1 << 32;
+    for (int j = m - n; j >= 0; j--)
+    {
+        // Estimate the quotient limb from the top two limbs
+        uint64_t top = ((uint64_t)un[j + n] << 32) | un[j + n - 1];
+        uint64_t qhat = top / vn[n - 1];
+        uint64_t rhat = top % vn[n - 1];
+        while (qhat >= base || qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2]))
+        {
+            qhat--;
+            rhat += vn[n - 1];
+            if (rhat >= base)
+            {
+                break;
+            }
+        }
+
+        // Multiply and subtract
+        int64_t k = 0;
+        int64_t t;
+        for (int i = 0; i < n; i++)
+        {
+            uint64_t p = qhat * vn[i];
+            t = (int64_t)un[i + j] - k - (int64_t)(p & 0xFFFFFFFF);
+            un[i + j] = (uint32_t)t;
+            k = (int64_t)(p >> 32) - (t >> 32);
+        }
+        t = (int64_t)un[j + n] - k;
+        un[j + n] = (uint32_t)t;
+
+        // The estimate was one too large: add the divisor back
+        if (t < 0)
+        {
+            qhat--;
+            uint64_t carry = 0;
+            for (int i = 0; i < n; i++)
+            {
+                carry += (uint64_t)un[i + j] + vn[i];
+                un[i + j] = (uint32_t)carry;
+                carry >>= 32;
+            }
+            un[j + n] += (uint32_t)carry;
+        }
+        q->limbs[j] = (uint32_t)qhat;
+    }
+
+    free(vn);
+    free(un);
+    return q;
+}
+
+// Compare two bignums (-1, 0 or 1)
+int lval_big_cmp(lval *a, lval *b)
+{
+    int c = lbig_cmp_mag(a, b);
+    if (c == 0)
+    {
+        return 0;
+    }
+    if (a->neg != b->neg)
+    {
+        return a->neg ? -1 : 1;
+    }
+    return a->neg ? -c : c;
+}
+
+// Parse a decimal literal (with an optional '-') into a bignum
+lval *lval_big_read(char *s)
+{
+    int neg = *s == '-';
+    if (neg)
+    {
+        s++;
+    }
+
+    // Each limb holds more than 9 digits
+    int len = strlen(s);
+    lval *v = lval_big(neg, len / 9 + 1);
+    int used = 0;
+    while (*s)
+    {
+        // Multiply by 10^k and add the next k digits
+        uint32_t chunk = 0;
+        uint32_t scale = 1;
+        for (int k = 0; k < 9 && *s; k++, s++)
+        {
+            chunk = chunk * 10 + (*s - '0');
+            scale *= 10;
+        }
+
+        uint64_t carry = chunk;
+        for (int i = 0; i < used; i++)
+        {
+            carry += (uint64_t)v->limbs[i] * scale;
+            v->limbs[i] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        if (carry)
+        {
+            v->limbs[used++] = (uint32_t)carry;
+        }
+    }
+    return v;
+}
+
+// Decimal representation of a bignum, to be freed by the caller
+char *lval_big_str(lval *v)
+{
+    // Split off 9 digits at a time by dividing a copy by 10^9
+    int n = v->nlimbs;
+    uint32_t *mag = malloc(sizeof(uint32_t) * (n ? n : 1));
+    memcpy(mag, v->limbs, sizeof(uint32_t) * n);
+    uint32_t *chunks = malloc(sizeof(uint32_t) * (n * 10 / 9 + 2));
+    int count = 0;
+    do
+    {
+        uint64_t rem = 0;
+        for (int i = n - 1; i >= 0; i--)
+        {
+            uint64_t cur = (rem << 32) | mag[i];
+            mag[i] = (uint32_t)(cur / 1000000000);
+            rem = cur % 1000000000;
+        }
+        chunks[count++] = (uint32_t)rem;
+        while (n > 0 && mag[n - 1] == 0)
+        {
+            n--;
+        }
+    } while (n > 0);
+
+    // The most significant chunk is printed without padding
+    char *str = malloc(count * 9 + 2);
+    int len = sprintf(str, "%s%u", v->neg ? "-" : "", chunks[count - 1]);
+    for (int i = count - 2; i >= 0; i--)
+    {
+        len += sprintf(str + len, "%09u", chunks[i]);
+    }
+
+    free(mag);
+    free(chunks);
+    return str;
+}
+
+// Apply the operation on the argument list
+// Numbers are folded with overflow checks, switching to bignums from the
+// first operation that overflows (or the first bignum argument)
+// Any float argument makes the whole operation floating point
+lval *builtin_op(lenv *e, lval *args, int op)
+{
+    char *name = lmath_names[op];
+
+    // Ensure all arguments are numbers
+    int floats = 0;
+    for (int i = 0; i < args->count; i++)
+    {
+        LASSERT_ARG_NUMBER(name, args, i);
+        floats |= args->cell[i]->type == LVAL_DBL;
+    }
+    if (floats)
+    {
+        return lval_dbl_fold(args, op);
+    }
+
+    // Perform unary negation
+    lval *first = args->cell[0];
+    if (args->count == 1 && op == LMATH_SUB)
+    {
+        if (first->type == LVAL_NUM && first->num != LONG_MIN)
+        {
+            return lval_num_result(args, -first->num);
+        }
+        lval *x = lval_to_big(first);
+        x = lval_unshare(x);
+        x->neg = !x->neg;
+        lval_del(args);
+        return lval_big_norm(x);
+    }
+
+    // Fold the arguments into the first one while they fit in a long
+    long x = 0;
+    int i = 1;
+    if (first->type == LVAL_NUM)
+    {
+        x = first->num;
+        for (; i < args->count && args->cell[i]->type == LVAL_NUM; i++)
+        {
+            long y = args->cell[i]->num;
+            long r = 0;
+            int overflow = 0;
+            switch (op)
+            {
+            case LMATH_ADD:
+                overflow = __builtin_add_overflow(x, y, &r);
+                break;
+            case LMATH_SUB:
+                overflow = __builtin_sub_overflow(x, y, &r);
+                break;
+            case LMATH_MUL:
+                overflow = __builtin_mul_overflow(x, y, &r);
+                break;
+            case LMATH_DIV:
+                if (y == 0)
+                {
+                    lval_del(args);
+                    return lval_err("Division by zero!");
+                }
+                overflow = x == LONG_MIN && y == -1;
+                r = overflow ? 0 : x / y;
+                break;
+            }
+            if (overflow)
+            {
+                break;
+            }
+            x = r;
+        }
+
+        if (i == args->count)
+        {
+            return lval_num_result(args, x);
+        }
+    }
+
+    // Continue with bignums from where the numbers stopped
+    lval *acc = first->type == LVAL_NUM ? lval_big_from(x) : lval_ref(first);
+    for (; i < args->count; i++)
+    {
+        lval *y = args->cell[i];
+        if (op == LMATH_DIV && y->type == LVAL_NUM && y->num == 0)
+        {
+            lval_del(acc);
+            lval_del(args);
+            return lval_err("Division by zero!");
+        }
+
+        y = lval_to_big(y);
+        lval *r = NULL;
+        switch (op)
+        {
+        case LMATH_ADD:
+            r = lval_big_add(acc, y, 0);
+            break;
+        case LMATH_SUB:
+            r = lval_big_add(acc, y, 1);
+            break;
+        case LMATH_MUL:
+            r = lval_big_mul(acc, y);
+            break;
+        case LMATH_DIV:
+            r = lval_big_div(acc, y);
+            break;
+        }
+        lval_del(y);
+        lval_del(acc);
+        acc = r;
+    }
+
+    lval_del(args);
+    return lval_big_norm(acc);
+}
+
+// Number result of a builtin, deletes args
+// The first argument is reused when nothing else refers to it
+lval *lval_num_result(lval *args, long num)
+{
+    lval *x = args->cell[0];
+    if (x->refs == 1 && x->type == LVAL_NUM)
+    {
+        // Keep it alive past the deletion of args
+        x->refs++;
+        x->num = num;
+    }
+    else
+    {
+        x = lval_num(num);
+    }
+
+    lval_del(args);
+    return x;
+}
+
+// Apply a numeric builtin to two numbers without building an argument list
+// Returns 0 when the call has to go through the builtin (errors and
+// overflows included)
+int lval_num_op2(lbuiltin f, long x, long y, long *r)
+{
+    if (f == builtin_add)
+    {
+        return !__builtin_add_overflow(x, y, r);
+    }
+    else if (f == builtin_sub)
+    {
+        return !__builtin_sub_overflow(x, y, r);
+    }
+    else if (f == builtin_mul)
+    {
+        return !__builtin_mul_overflow(x, y, r);
+    }
+    else if (f == builtin_div && y != 0 && !(x == LONG_MIN && y == -1))
+    {
+        *r = x / y;
+    }
+    else if (f == builtin_gt)
+    {
+        *r = x > y;
+    }
+    else if (f == builtin_ge)
+    {
+        *r = x >= y;
+    }
+    else if (f == builtin_lt)
+    {
+        *r = x < y;
+    }
+    else if (f == builtin_le)
+    {
+        *r = x <= y;
+    }
+    else if (f == builtin_eq)
+    {
+        *r = x == y;
+    }
+    else if (f == builtin_ne)
+    {
+        *r = x != y;
+    }
+    else
+    {
+        return 0;
+    }
+    return 1;
+}
+
+// Apply a numeric builtin to two floats, like lval_num_op2
+// Returns the type of the result (comparisons give a number), or LVAL_ERR
+// when the call has to go through the builtin
+int lval_dbl_op2(lbuiltin f, double x, double y, double *r)
+{
+    if (f == builtin_add)
+    {
+        *r = x + y;
+    }
+    else if (f == builtin_sub)
+    {
+        *r = x - y;
+    }
+    else if (f == builtin_mul)
+    {
+        *r = x * y;
+    }
+    else if (f == builtin_div)
+    {
+        *r = x / y;
+    }
+    else if (f == builtin_gt)
+    {
+        *r = x > y;
+        return LVAL_NUM;
+    }
+    else if (f == builtin_ge)
+    {
+        *r = x >= y;
+        return LVAL_NUM;
+    }
+    else if (f == builtin_lt)
+    {
+        *r = x < y;
+        return LVAL_NUM;
+    }
+    else if (f == builtin_le)
+    {
+        *r = x <= y;
+        return LVAL_NUM;
+    }
+    else if (f == builtin_eq)
+    {
+        *r = x == y;
+        return LVAL_NUM;
+    }
+    else if (f == builtin_ne)
+    {
+        *r = x != y;
+        return LVAL_NUM;
+    }
+    else
+    {
+        return LVAL_ERR;
+    }
+    return LVAL_DBL;
+}
+
+// Apply a numeric builtin to two numbers or floats without building an
+// argument list. Deletes x and y and returns the result, or returns NULL
+// (leaving x and y alone) when the call has to go through the builtin.
+// The result is written into x when nothing else refers to it.
+lval *lval_op2(lbuiltin f, lval *x, lval *y)
+{
+    int type;
+    long num;
+    double dbl;
+    if (x->type == LVAL_NUM && y->type == LVAL_NUM)
+    {
+        if (!lval_num_op2(f, x->num, y->num, &num))
+        {
+            return NULL;
+        }
+        type = LVAL_NUM;
+    }
+    else if ((x->type == LVAL_DBL || x->type == LVAL_NUM) &&
+             (y->type == LVAL_DBL || y->type == LVAL_NUM))
+    {
+        type = lval_dbl_op2(f, lval_to_dbl(x), lval_to_dbl(y), &dbl);
+        if (type == LVAL_ERR)
+        {
+            return NULL;
+        }
+
+        // Comparisons give 0 or 1. Arithmetic results stay floats, they may
+        // not fit in a long (or be inf or nan).
+        if (type == LVAL_NUM)
+        {
+            num = (long)dbl;
+        }
+    }
+    else
+    {
+        return NULL;
+    }
+
+    lval_del(y);
+    if (x->refs > 1)
+    {
+        lval_del(x);
+        x = lval_alloc();
+    }
+    x->type = type;
+    if (type == LVAL_DBL)
+    {
+        x->dbl = dbl;
+    }
+    else
+    {
+        x->num = num;
+    }
+    return x;
+}
+
+// Apply the operation on the argument list in floating point, deletes args
+lval *lval_dbl_fold(lval *args, int op)
+{
+    double x = lval_to_dbl(args->cell[0]);
+    if (args->count == 1 && op == LMATH_SUB)
+    {
+        x = -x;
+    }
+
+    for (int i = 1; i < args->count; i++)
+    {
+        double y = lval_to_dbl(args->cell[i]);
+        switch (op)
+        {
+        case LMATH_ADD:
+            x += y;
+            break;
+        case LMATH_SUB:
+            x -= y;
+            break;
+        case LMATH_MUL:
+            x *= y;
+            break;
+        case LMATH_DIV:
+            x /= y;
+            break;
+        }
+    }
+
+    // Reuse the first argument like lval_num_result
+    lval *r = args->cell[0];
+    if (r->refs == 1 && r->type == LVAL_DBL)
+    {
+        r->refs++;
+        r->dbl = x;
+    }
+    else
+    {
+        r = lval_dbl(x);
+    }
+    lval_del(args);
+    return r;
+}
+
+// Check for a number, bignum or float
+int lval_is_number(lval *v)
+{
+    return v->type == LVAL_NUM || v->type == LVAL_BIG || v->type == LVAL_DBL;
+}
+
+// Check if a number (bignum or float) is a true condition: not zero
+// A bignum is never zero
+int lval_is_true(lval *v)
+{
+    return v->type == LVAL_BIG || (v->type == LVAL_DBL ? v->dbl != 0 : v->num != 0);
+}
+
+// Value of a number, bignum or float as a float
+double lval_to_dbl(lval *v)
+{
+    switch (v->type)
+    {
+    case LVAL_NUM:
+        return (double)v->num;
+    case LVAL_DBL:
+        return v->dbl;
+    case LVAL_BIG:
+    {
+        double x = 0;
+        for (int i = v->nlimbs - 1; i >= 0; i--)
+        {
+            x = x * 4294967296.0 + v->limbs[i];
+        }
+        return v->neg ? -x : x;
+    }
+    default:
+        return 0;
+    }
+}
+
+// Built-in math functions
+lval *builtin_add(lenv *e, lval *args)
+{
+    return builtin_op(e, args, LMATH_ADD);
+}
+lval *builtin_sub(lenv *e, lval *args)
+{
+    return builtin_op(e, args, LMATH_SUB);
+}
+lval *builtin_mul(lenv *e, lval *args)
+{
+    return builtin_op(e, args, LMATH_MUL);
+}
+lval *builtin_div(lenv *e, lval *args)
+{
+    return builtin_op(e, args, LMATH_DIV);
+}
+
+// Takes a Q-Expression and returns a Q-Expression with only the first element
+lval *builtin_head(lenv *e, lval *args)
+{
+    const char *func_name = "head";
+    LASSERT_NUM_ARGS(func_name, args, 1);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY(func_name, args, 0);
+
+    // Build a new list sharing the first element
+    lval *v = lval_add(lval_qexpr(), lval_ref(args->cell[0]->cell[0]));
+    lval_del(args);
+    return v;
+}
+
+// Takes a Q-Expression and returns a Q-Expression with the first element removed
+lval *builtin_tail(lenv *e, lval *args)
+{
+    const char *func_name = "tail";
+    LASSERT_NUM_ARGS(func_name, args, 1);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY(func_name, args, 0);
+
+    // Pop the first element and delete args
+    lval *v = lval_unshare(lval_take(args, 0));
+
+    // Delete the first element and return
+    lval_del(lval_pop(v, 0));
+    return v;
+}
+
+// Returns a new Q-Expression containing the arguments
+lval *builtin_list(lenv *e, lval *args)
+{
+    args->type = LVAL_QEXPR;
+    return args;
+}
+
+// Takes a Q-Expression and evaluates it as if it were a S-Expression
+lval *builtin_eval(lenv *e, lval *args)
+{
+    lval *v = lval_eval_expr(args);
+    if (v->type == LVAL_ERR)
+    {
+        return v;
+    }
+
+    // The code was written in a caller (see lenv_get)
+    e->evals++;
+    lval *x = lval_eval(e, v);
+    e->evals--;
+    return x;
+}
+
+// Expression evaluated by 'eval' (or an error), deletes args
+lval *lval_eval_expr(lval *args)
+{
+    const char *func_name = "eval";
+    LASSERT_NUM_ARGS(func_name, args, 1);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_QEXPR);
+
+    lval *v = lval_unshare(lval_take(args, 0));
+    v->type = LVAL_SEXPR;
+    return v;
+}
+
+// Returns a Q-Expression by joining Q-Expressions together
+lval *builtin_join(lenv *e, lval *args)
+{
+    const char *func_name = "join";
+
+    for (int i = 0; i < args->count; i++)
+    {
+        LASSERT_ARG_TYPE(func_name, args, i, LVAL_QEXPR);
+    }
+
+    lval *v = lval_pop(args, 0);
+    while (args->count > 0)
+    {
+        v = lval_join(v, lval_pop(args, 0));
+    }
+
+    lval_del(args);
+    return v;
+}
+
+// Helper for builtin_join - join 2 Q-Expressions together
+// Takes over both references. When there are free slots next to one side
+// in its buffer (that can take the elements, see lcells_can_take), only the
+// other side is copied there: the elements of y after x, or those of x
+// before y. Otherwise both are copied into a new
+// buffer with room on both sides, so building a list one element at a
+// time, from either end, is amortized O(1) per element.
+lval *lval_join(lval *x, lval *y)
+{
+    if (y->count == 0)
+    {
+        lval_del(y);
+        return x;
+    }
+    if (x->count == 0)
+    {
+        lval_del(x);
+        return y;
+    }
+
+    int nx = x->count;
+    int ny = y->count;
+    lcells *bx = x->buf;
+    lcells *by = y->buf;
+    int append = x->cell + nx == bx->slots + bx->hi &&
+                 x->cell + nx + ny <= bx->slots + bx->capacity &&
+                 lcells_can_take(x, y->cell, ny);
+    int prepend = y->cell == by->slots + by->lo && by->lo >= nx &&
+                  lcells_can_take(y, x->cell, nx);
+
+    if (append && (!prepend || ny <= nx))
+    {
+        // Copy y after x, in the buffer of x
+        x = lval_unshare(x);
+        y = lval_unshare(y);
+        lval_move_cells(y, bx->slots + bx->hi);
+        lval_del(y);
+        bx->hi += ny;
+        x->count += ny;
+        return x;
+    }
+
+    if (prepend)
+    {
+        // Copy x before y, in the buffer of y
+        int type = x->type;
+        x = lval_unshare(x);
+        y = lval_unshare(y);
+        lval_move_cells(x, by->slots + by->lo - nx);
+        lval_del(x);
+        by->lo -= nx;
+        y->type = type;
+        y->cell -= nx;
+        y->count += nx;
+        return y;
+    }
+
+    // Copy both into the middle of a new buffer
+    lcells *b = lcells_alloc(lcells_capacity(2 * (nx + ny)));
+    b->lo = (b->capacity - nx - ny) / 2;
+    b->hi = b->lo + nx + ny;
+    x = lval_unshare(x);
+    y = lval_unshare(y);
+    lval_move_cells(x, b->slots + b->lo);
+    lval_move_cells(y, b->slots + b->lo + nx);
+    lval_del(y);
+    x->count = nx + ny;
+    x->cell = b->slots + b->lo;
+    x->buf = b;
+    return x;
+}
+
+// Number of elements of a Q-Expression
+lval *builtin_len(lenv *e, lval *args)
+{
+    const char *func_name = "len";
+    LASSERT_NUM_ARGS(func_name, args, 1);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_QEXPR);
+
+    lval *x = lval_num(args->cell[0]->count);
+    lval_del(args);
+    return x;
+}
+
+// Element at an index of a Q-Expression
+lval *builtin_nth(lenv *e, lval *args)
+{
+    const char *func_name = "nth";
+    LASSERT_NUM_ARGS(func_name, args, 2);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_NUM);
+    LASSERT_ARG_TYPE(func_name, args, 1, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY(func_name, args, 1);
+    LASSERT_INDEX(func_name, args, 0, 0, args->cell[1]->count - 1);
+
+    lval *x = lval_ref(args->cell[1]->cell[args->cell[0]->num]);
+    lval_del(args);
+    return x;
+}
+
+// Last element of a Q-Expression
+lval *builtin_last(lenv *e, lval *args)
+{
+    const char *func_name = "last";
+    LASSERT_NUM_ARGS(func_name, args, 1);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY(func_name, args, 0);
+
+    lval *lst = args->cell[0];
+    lval *x = lval_ref(lst->cell[lst->count - 1]);
+    lval_del(args);
+    return x;
+}
+
+// Q-Expression of the first n elements
+// O(1), the elements are not copied
+lval *builtin_take(lenv *e, lval *args)
+{
+    const char *func_name = "take";
+    LASSERT_NUM_ARGS(func_name, args, 2);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_NUM);
+    LASSERT_ARG_TYPE(func_name, args, 1, LVAL_QEXPR);
+    LASSERT_INDEX(func_name, args, 0, 0, args->cell[1]->count);
+
+    int n = args->cell[0]->num;
+    return lval_slice(lval_take(args, 1), 0, n);
+}
+
+// Q-Expression without the first n elements
+// O(1), the elements are not copied
+lval *builtin_drop(lenv *e, lval *args)
+{
+    const char *func_name = "drop";
+    LASSERT_NUM_ARGS(func_name, args, 2);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_NUM);
+    LASSERT_ARG_TYPE(func_name, args, 1, LVAL_QEXPR);
+    LASSERT_INDEX(func_name, args, 0, 0, args->cell[1]->count);
+
+    int n = args->cell[0]->num;
+    lval *lst = lval_take(args, 1);
+    return lval_slice(lst, n, lst->count);
+}
+
+// Check if a Q-Expression has an element equal to x
+lval *builtin_elem(lenv *e, lval *args)
+{
+    const char *func_name = "elem";
+    LASSERT_NUM_ARGS(func_name, args, 2);
+    LASSERT_ARG_TYPE(func_name, args, 1, LVAL_QEXPR);
+
+    lval *x = args->cell[0];
+    lval *lst = args->cell[1];
+    int found = 0;
+    for (int i = 0; i < lst->count && !found; i++)
+    {
+        found = lval_eq(x, lst->cell[i]);
+    }
+    lval_del(args);
+    return lval_num(found);
+}
+
+// Q-Expression of the results of a function applied to each element
+// The elements are passed as they are (not evaluated again like 'first'
+// does), and the first error stops the walk
+lval *builtin_map(lenv *e, lval *args)
+{
+    const char *func_name = "map";
+    LASSERT_NUM_ARGS(func_name, args, 2);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_FUN);
+    LASSERT_ARG_TYPE(func_name, args, 1, LVAL_QEXPR);
+
+    lval *f = args->cell[0];
+    lval *lst = args->cell[1];
+    lval *x = lval_qexpr();
+    lval_reserve(x, lst->count);
+    for (int i = 0; i < lst->count; i++)
+    {
+        lval *r = lval_call(e, f, lval_add(lval_sexpr(), lval_ref(lst->cell[i])));
+        if (r->type == LVAL_ERR)
+        {
+            lval_del(x);
+            x = r;
+            break;
+        }
+        lval_add(x, r);
+    }
+    lval_del(args);
+    return x;
+}
+
+// Q-Expression of the elements a predicate is true for (see builtin_map)
+lval *builtin_filter(lenv *e, lval *args)
+{
+    const char *func_name = "filter";
+    LASSERT_NUM_ARGS(func_name, args, 2);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_FUN);
+    LASSERT_ARG_TYPE(func_name, args, 1, LVAL_QEXPR);
+
+    lval *f = args->cell[0];
+    lval *lst = args->cell[1];
+    lval *x = lval_qexpr();
+    for (int i = 0; i < lst->count; i++)
+    {
+        lval *r = lval_call(e, f, lval_add(lval_sexpr(), lval_ref(lst->cell[i])));
+        if (r->type != LVAL_ERR && !lval_is_number(r))
+        {
+            lval *err = lval_err("Function '%s' received %s from the predicate. Expected %s.",
+                                 func_name, ltype_name(r->type), ltype_name(LVAL_NUM));
+            lval_del(r);
+            r = err;
+        }
+        if (r->type == LVAL_ERR)
+        {
+            lval_del(x);
+            x = r;
+            break;
+        }
+        if (lval_is_true(r))
+        {
+            lval_add(x, lval_ref(lst->cell[i]));
+        }
+        lval_del(r);
+    }
+    lval_del(args);
+    return x;
+}
+
+// Combine the elements from the left: (f (f (f base x1) x2) x3) ...
+// (see builtin_map)
+lval *builtin_foldl(lenv *e, lval *args)
+{
+    const char *func_name = "foldl";
+    LASSERT_NUM_ARGS(func_name, args, 3);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_FUN);
+    LASSERT_ARG_TYPE(func_name, args, 2, LVAL_QEXPR);
+
+    lval *f = args->cell[0];
+    lval *lst = args->cell[2];
+    lval *acc = lval_ref(args->cell[1]);
+    for (int i = 0; i < lst->count && acc->type != LVAL_ERR; i++)
+    {
+        lval *call = lval_add(lval_add(lval_sexpr(), acc), lval_ref(lst->cell[i]));
+        acc = lval_call(e, f, call);
+    }
+    lval_del(args);
+    return acc;
+}
+
+// Vector with the elements of a Q-Expression (or a copy of a vector)
+// The elements are taken over when the Q-Expression is not shared
+lval *builtin_vec(lenv *e, lval *args)
+{
+    const char *func_name = "vec";
+    LASSERT_NUM_ARGS(func_name, args, 1);
+    LASSERT(args, args->cell[0]->type == LVAL_QEXPR || args->cell[0]->type == LVAL_VEC,
+            "Function '%s' received incorrect type for argument %i. Expected %s. Got %s.",
+            func_name, 0, ltype_name(LVAL_QEXPR), ltype_name(args->cell[0]->type));
+
+    lval *v = lval_unshare(lval_take(args, 0));
+    v->type = LVAL_VEC;
+    return v;
+}
+
+// Element at an index of a vector
+lval *builtin_vget(lenv *e, lval *args)
+{
+    const char *func_name = "vget";
+    LASSERT_NUM_ARGS(func_name, args, 2);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_VEC);
+    LASSERT_ARG_TYPE(func_name, args, 1, LVAL_NUM);
+    LASSERT_INDEX(func_name, args, 1, 0, args->cell[0]->count - 1);
+
+    lval *x = lval_ref(args->cell[0]->cell[args->cell[1]->num]);
+    lval_del(args);
+    return x;
+}
+
+// Vector with the element at an index replaced
+// The vector is modified in place when it is not shared
+lval *builtin_vset(lenv *e, lval *args)
+{
+    const char *func_name = "vset";
+    LASSERT_NUM_ARGS(func_name, args, 3);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_VEC);
+    LASSERT_ARG_TYPE(func_name, args, 1, LVAL_NUM);
+    LASSERT_INDEX(func_name, args, 1, 0, args->cell[0]->count - 1);
+
+    long i = args->cell[1]->num;
+    lval *x = lval_pop(args, 2);
+    lval *v = lval_unshare(lval_take(args, 0));
+    lval_own(v);
+    lval_del(v->cell[i]);
+    v->cell[i] = x;
+    return v;
+}
+
+// Number of elements of a vector
+lval *builtin_vlen(lenv *e, lval *args)
+{
+    const char *func_name = "vlen";
+    LASSERT_NUM_ARGS(func_name, args, 1);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_VEC);
+
+    return lval_num_result(args, args->cell[0]->count);
+}
+
+// Vector with an element added at the end
+// The vector grows in place (amortized O(1)) when it is not shared
+lval *builtin_vpush(lenv *e, lval *args)
+{
+    const char *func_name = "vpush";
+    LASSERT_NUM_ARGS(func_name, args, 2);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_VEC);
+
+    lval *x = lval_pop(args, 1);
+    lval *v = lval_unshare(lval_take(args, 0));
+    return lval_add(v, x);
+}
+
+// Vector of the elements from index start up to (not including) end
+// O(1), the elements are not copied
+lval *builtin_vslice(lenv *e, lval *args)
+{
+    const char *func_name = "vslice";
+    LASSERT_NUM_ARGS(func_name, args, 3);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_VEC);
+    LASSERT_ARG_TYPE(func_name, args, 1, LVAL_NUM);
+    LASSERT_ARG_TYPE(func_name, args, 2, LVAL_NUM);
+    LASSERT_INDEX(func_name, args, 1, 0, args->cell[0]->count);
+    LASSERT_INDEX(func_name, args, 2, args->cell[1]->num, args->cell[0]->count);
+
+    int start = args->cell[1]->num;
+    int end = args->cell[2]->num;
+    return lval_slice(lval_take(args, 0), start, end);
+}
+
+// Mix the bits of a 64-bit word (the finalizer of MurmurHash3), so that
+// the low bits of the hash depend on all of them
+unsigned lhash_mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb93fe1a85ec3ULL;
+    x ^= x >> 33;
+    return (unsigned)x;
+}
+
+// Hash of a value, the same for values lval_eq finds equal
+// Numbers are hashed by their value as a float, since a float equals a
+// number of the same value. Map entries are combined in any order.
+unsigned lval_hash(lval *v)
+{
+    switch (v->type)
+    {
+    case LVAL_NUM:
+    case LVAL_BIG:
+    case LVAL_DBL:
+    {
+        // 0.0 and -0.0 are equal
+        double d = lval_to_dbl(v);
+        uint64_t bits = 0;
+        if (d != 0)
+        {
+            memcpy(&bits, &d, sizeof(bits));
+        }
+        return lhash_mix(bits);
+    }
+    case LVAL_ERR:
+        return lsym_hash_name(v->err, strlen(v->err));
+    case LVAL_SYM:
+        return lsym_hash(v->sym);
+    case LVAL_STR:
+        return lsym_hash_name(v->str, strlen(v->str));
+    case LVAL_FUN:
+        if (v->builtin)
+        {
+            return lhash_mix((uintptr_t)v->builtin);
+        }
+        return lval_hash(v->formals) * 31 + lval_hash(v->body);
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_VEC:
+    {
+        unsigned h = v->type;
+        for (int i = 0; i < v->count; i++)
+        {
+            h = h * 31 + lval_hash(v->cell[i]);
+        }
+        return h;
+    }
+    case LVAL_MAP:
+    {
+        unsigned h = v->type;
+        lmap_iter it;
+        lmap_iter_init(&it, v);
+        for (lval **entry; (entry = lmap_next(&it));)
+        {
+            h += lhash_mix((uint64_t)lval_hash(entry[0]) << 32 | lval_hash(entry[1]));
+        }
+        return h;
+    }
+    default:
+        return 0;
+    }
+}
+
+// Entries a node of a map holds itself (the others are in the nodes below)
+int lmap_ndata(lval *m)
+{
+    // Only a collision node (or an empty map) has neither map set
+    return m->datamap | m->nodemap ? __builtin_popcount(m->datamap) : m->nentries;
+}
+
+// Slots of a node of a map: keys and values, then nodes
+int lmap_nslots(lval *m)
+{
+    return 2 * lmap_ndata(m) + __builtin_popcount(m->nodemap);
+}
+
+// Start a walk over the entries of a map
+void lmap_iter_init(lmap_iter *it, lval *m)
+{
+    it->nodes[0] = m;
+    it->next[0] = 0;
+    it->depth = 0;
+}
+
+// Next entry of a walk over a map (its key, followed by its value), or NULL
+// once they have all been seen
+lval **lmap_next(lmap_iter *it)
+{
+    while (it->depth >= 0)
+    {
+        lval *m = it->nodes[it->depth];
+        int i = it->next[it->depth]++;
+        int ndata = lmap_ndata(m);
+        if (i < ndata)
+        {
+            return &m->slots[2 * i];
+        }
+        if (i < ndata + __builtin_popcount(m->nodemap))
+        {
+            // Entries of the node below first
+            it->depth++;
+            it->nodes[it->depth] = m->slots[ndata + i];
+            it->next[it->depth] = 0;
+            continue;
+        }
+        it->depth--;
+    }
+    return NULL;
+}
+
+// Slot of the value of a key in a map, or NULL if the key is not there
+lval **lmap_find(lval *m, lval *k)
+{
+    unsigned h = lval_hash(k);
+    for (int shift = 0; shift < 32; shift += 5)
+    {
+        uint32_t bit = 1u << ((h >> shift) & 31);
+        if (m->datamap & bit)
+        {
+            lval **e = &m->slots[2 * __builtin_popcount(m->datamap & (bit - 1))];
+            return lval_eq(e[0], k) ? &e[1] : NULL;
+        }
+        if (!(m->nodemap & bit))
+        {
+            return NULL;
+        }
+        m = m->slots[2 * __builtin_popcount(m->datamap) +
+                     __builtin_popcount(m->nodemap & (bit - 1))];
+    }
+
+    // Collision node
+    for (int i = 0; i < m->nentries; i++)
+    {
+        if (lval_eq(m->slots[2 * i], k))
+        {
+            return &m->slots[2 * i + 1];
+        }
+    }
+    return NULL;
+}
+
+// Make room for n slots at index i among the len slots of a node
+void lmap_open(lval *m, int len, int i, int n)
+{
+    m->slots = realloc(m->slots, sizeof(lval *) * (len + n));
+    memmove(m->slots + i + n, m->slots + i, sizeof(lval *) * (len - i));
+}
+
+// Remove the n slots at index i from the len slots of a node (the values
+// in them are not deleted)
+void lmap_close(lval *m, int len, int i, int n)
+{
+    memmove(m->slots + i, m->slots + i + n, sizeof(lval *) * (len - i - n));
+}
+
+// Node of two entries with different keys, at the level of shift (ha and
+// hb are the hashes of the keys). Takes over the references in a and b,
+// each a key followed by its value.
+lval *lmap_pair(lval **a, unsigned ha, lval **b, unsigned hb, int shift)
+{
+    lval *m = lval_map();
+    m->nentries = 2;
+    if (shift >= 32)
+    {
+        // The hashes are the same
+        m->slots = malloc(sizeof(lval *) * 4);
+        memcpy(m->slots, a, sizeof(lval *) * 2);
+        memcpy(m->slots + 2, b, sizeof(lval *) * 2);
+        return m;
+    }
+
+    unsigned ia = (ha >> shift) & 31;
+    unsigned ib = (hb >> shift) & 31;
+    if (ia == ib)
+    {
+        // Same bits at this level too: both go one level down
+        m->nodemap = 1u << ia;
+        m->slots = malloc(sizeof(lval *));
+        m->slots[0] = lmap_pair(a, ha, b, hb, shift + 5);
+        return m;
+    }
+
+    // In the order of their bits
+    m->datamap = (1u << ia) | (1u << ib);
+    m->slots = malloc(sizeof(lval *) * 4);
+    memcpy(m->slots + (ia < ib ? 0 : 2), a, sizeof(lval *) * 2);
+    memcpy(m->slots + (ia < ib ? 2 : 0), b, sizeof(lval *) * 2);
+    return m;
+}
+
+// Node of a map with the value of a key set, at the level of shift (h is
+// the hash of k). Takes over the references to m, k and x.
+// The node is changed in place when it is not shared, and copied
+// otherwise: only the nodes on the path to the key are copied, the others
+// are shared with the old version.
+lval *lmap_assoc(lval *m, lval *k, lval *x, unsigned h, int shift)
+{
+    m = lval_unshare(m);
+    lmap_insert(m, k, x, h, shift);
+    return m;
+}
+
+// Set the value of a key in a node of a map, in place (see lmap_assoc)
+void lmap_insert(lval *m, lval *k, lval *x, unsigned h, int shift)
+{
+    int len = lmap_nslots(m);
+    if (shift >= 32)
+    {
+        // Collision node: the entries are in no particular order
+        for (int i = 0; i < m->nentries; i++)
+        {
+            if (lval_eq(m->slots[2 * i], k))
+            {
+                lval_del(k);
+                lval_del(m->slots[2 * i + 1]);
+                m->slots[2 * i + 1] = x;
+                return;
+            }
+        }
+        lmap_open(m, len, len, 2);
+        m->slots[len] = k;
+        m->slots[len + 1] = x;
+        m->nentries++;
+        return;
+    }
+
+    uint32_t bit = 1u << ((h >> shift) & 31);
+    int i = 2 * __builtin_popcount(m->datamap & (bit - 1));
+    int j = 2 * __builtin_popcount(m->datamap) + __builtin_popcount(m->nodemap & (bit - 1));
+    if (m->datamap & bit)
+    {
+        lval **e = &m->slots[i];
+        if (lval_eq(e[0], k))
+        {
+            // The key is already there, only its value changes
+            lval_del(k);
+            lval_del(e[1]);
+            e[1] = x;
+            return;
+        }
+
+        // Another key with the same bits: both go in a node below
+        lval *pair[2] = {k, x};
+        lval *sub = lmap_pair(e, lval_hash(e[0]), pair, h, shift + 5);
+        lmap_close(m, len, i, 2);
+        lmap_open(m, len - 2, j - 2, 1);
+        m->slots[j - 2] = sub;
+        m->datamap ^= bit;
+        m->nodemap |= bit;
+    }
+    else if (m->nodemap & bit)
+    {
+        int before = m->slots[j]->nentries;
+        m->slots[j] = lmap_assoc(m->slots[j], k, x, h, shift + 5);
+        m->nentries += m->slots[j]->nentries - before;
+        return;
+    }
+    else
+    {
+        lmap_open(m, len, i, 2);
+        m->slots[i] = k;
+        m->slots[i + 1] = x;
+        m->datamap |= bit;
+    }
+    m->nentries++;
+}
+
+// Node of a map without a key that is in it, at the level of shift (h is
+// the hash of k). Takes over the reference to m, which is changed in place
+// or copied like in lmap_assoc.
+// A node left with a single entry below is merged into this one, so a map
+// has the same shape whatever order its keys were added in.
+lval *lmap_dissoc(lval *m, lval *k, unsigned h, int shift)
+{
+    m = lval_unshare(m);
+    int len = lmap_nslots(m);
+    m->nentries--;
+    if (shift >= 32)
+    {
+        // Collision node
+        int i = 0;
+        while (!lval_eq(m->slots[2 * i], k))
+        {
+            i++;
+        }
+        lval_del(m->slots[2 * i]);
+        lval_del(m->slots[2 * i + 1]);
+        lmap_close(m, len, 2 * i, 2);
+        return m;
+    }
+
+    uint32_t bit = 1u << ((h >> shift) & 31);
+    int i = 2 * __builtin_popcount(m->datamap & (bit - 1));
+    if (m->datamap & bit)
+    {
+        lval_del(m->slots[i]);
+        lval_del(m->slots[i + 1]);
+        lmap_close(m, len, i, 2);
+        m->datamap ^= bit;
+        return m;
+    }
+
+    int j = 2 * __builtin_popcount(m->datamap) + __builtin_popcount(m->nodemap & (bit - 1));
+    lval *sub = lmap_dissoc(m->slots[j], k, h, shift + 5);
+    if (sub->nentries > 1)
+    {
+        m->slots[j] = sub;
+        return m;
+    }
+
+    // The last entry of the node below moves up here
+    lmap_close(m, len, j, 1);
+    lmap_open(m, len - 1, i, 2);
+    m->slots[i] = lval_ref(sub->slots[0]);
+    m->slots[i + 1] = lval_ref(sub->slots[1]);
+    lval_del(sub);
+    m->nodemap ^= bit;
+    m->datamap |= bit;
+    return m;
+}
+
+// Set the value of a key in a map that is being built, in place even if
+// it is already referred to (by the table of a serializer)
+// Takes over the references to k and x
+void lmap_put(lval *m, lval *k, lval *x)
+{
+    lmap_insert(m, k, x, lval_hash(k), 0);
+}
+
+// Set the keys and values given in turn in args (deleted) into a map
+// Takes over the reference to m, and returns the new version
+lval *lmap_put_pairs(lval *m, lval *args)
+{
+    while (args->count > 0)
+    {
+        lval *k = lval_pop(args, 0);
+        m = lmap_assoc(m, k, lval_pop(args, 0), lval_hash(k), 0);
+    }
+    lval_del(args);
+    return m;
+}
+
+// Map of the keys and values given in turn
+lval *builtin_hash_map(lenv *e, lval *args)
+{
+    const char *func_name = "hash-map";
+    LASSERT(args, args->count % 2 == 0,
+            "Function '%s' received incorrect number of arguments. Expected keys and values in pairs. Got %i.",
+            func_name, args->count);
+
+    return lmap_put_pairs(lval_map(), args);
+}
+
+// Value of a key in a map
+// The third argument (or {} without it) is returned when the key is missing
+lval *builtin_get(lenv *e, lval *args)
+{
+    const char *func_name = "get";
+    LASSERT(args, args->count == 2 || args->count == 3,
+            "Function '%s' received incorrect number of arguments. Expected 2 or 3. Got %i.",
+            func_name, args->count);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_MAP);
+
+    lval **slot = lmap_find(args->cell[0], args->cell[1]);
+    lval *x = slot                 ? lval_ref(*slot)
+              : args->count == 3 ? lval_ref(args->cell[2])
+                                 : lval_qexpr();
+    lval_del(args);
+    return x;
+}
+
+// Map with the values of keys set (keys and values given in turn)
+// The map is modified in place when it is not shared, otherwise the new
+// version shares all but O(log n) nodes with it
+lval *builtin_assoc(lenv *e, lval *args)
+{
+    const char *func_name = "assoc";
+    LASSERT(args, args->count % 2 == 1,
+            "Function '%s' received incorrect number of arguments. Expected a map, then keys and values in pairs. Got %i.",
+            func_name, args->count);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_MAP);
+
+    return lmap_put_pairs(lval_pop(args, 0), args);
+}
+
+// Map without the given keys
+// The map is modified in place when it is not shared (see builtin_assoc)
+lval *builtin_dissoc(lenv *e, lval *args)
+{
+    const char *func_name = "dissoc";
+    LASSERT(args, args->count > 0,
+            "Function '%s' received incorrect number of arguments. Expected at least 1. Got %i.",
+            func_name, args->count);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_MAP);
+
+    lval *m = lval_pop(args, 0);
+    for (int i = 0; i < args->count; i++)
+    {
+        // Nothing is copied for a key that is not there
+        if (lmap_find(m, args->cell[i]))
+        {
+            m = lmap_dissoc(m, args->cell[i], lval_hash(args->cell[i]), 0);
+        }
+    }
+    lval_del(args);
+    return m;
+}
+
+// Q-Expression of the keys of a map
+lval *builtin_keys(lenv *e, lval *args)
+{
+    const char *func_name = "keys";
+    LASSERT_NUM_ARGS(func_name, args, 1);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_MAP);
+
+    lval *m = args->cell[0];
+    lval *x = lval_qexpr();
+    lval_reserve(x, m->nentries);
+    lmap_iter it;
+    lmap_iter_init(&it, m);
+    for (lval **entry; (entry = lmap_next(&it));)
+    {
+        lval_add(x, lval_ref(entry[0]));
+    }
+    lval_del(args);
+    return x;
+}
+
+// Q-Expression of the values of a map, in the order of its keys
+lval *builtin_vals(lenv *e, lval *args)
+{
+    const char *func_name = "vals";
+    LASSERT_NUM_ARGS(func_name, args, 1);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_MAP);
+
+    lval *m = args->cell[0];
+    lval *x = lval_qexpr();
+    lval_reserve(x, m->nentries);
+    lmap_iter it;
+    lmap_iter_init(&it, m);
+    for (lval **entry; (entry = lmap_next(&it));)
+    {
+        lval_add(x, lval_ref(entry[1]));
+    }
+    lval_del(args);
+    return x;
+}
+
+// Create new environment
+lenv *lenv_new()
+{
+    if (++gc.allocated >= gc.threshold)
+    {
+        lgc_collect();
+    }
+
+    lenv *e = lpool_alloc(&heap.lenvs);
+    e->refs = 1;
+    e->parent = NULL;
+    e->caller = NULL;
+    e->evals = 0;
+    e->count = 0;
+    e->capacity = 0;
+    e->syms = NULL;
+    e->vals = NULL;
+    e->index_size = 0;
+    e->index = NULL;
+    lgc_track(e);
+    return e;
+}
+
+// Delete an environment (drop a reference, free with the last one)
+void lenv_del(lenv *e)
+{
+    if (--e->refs > 0)
+    {
+        return;
+    }
+
+    lenv_clear(e);
+    if (e->parent)
+    {
+        lenv_del(e->parent);
+    }
+    free(e->syms);
+    free(e->vals);
+    free(e->index);
+    lgc_untrack(e);
+    lpool_free(&heap.lenvs, e);
+}
+
+// Add a reference to an environment
+lenv *lenv_ref(lenv *e)
+{
+    e->refs++;
+    return e;
+}
+
+// Remove all bindings
+void lenv_clear(lenv *e)
+{
+    // Values may refer back to e, so detach them before deleting
+    int count = e->count;
+    e->count = 0;
+    if (e->index)
+    {
+        memset(e->index, -1, sizeof(int) * e->index_size);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        lval_del(e->vals[i]);
+    }
+}
+
+// Position of a symbol in the current environment (-1 if not found)
+int lenv_find(lenv *e, char *sym)
+{
+    // Small environments are scanned directly
+    if (!e->index)
+    {
+        for (int i = 0; i < e->count; i++)
+        {
+            if (e->syms[i] == sym)
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Linear probing until the symbol or an empty slot is found
+    unsigned mask = e->index_size - 1;
+    for (unsigned i = lsym_hash(sym) & mask;; i = (i + 1) & mask)
+    {
+        int pos = e->index[i];
+        if (pos < 0 || e->syms[pos] == sym)
+        {
+            return pos;
+        }
+    }
+}
+
+// Rebuild the hash index with the given number of slots
+void lenv_reindex(lenv *e, int size)
+{
+    free(e->index);
+    e->index_size = size;
+    e->index = malloc(sizeof(int) * size);
+    memset(e->index, -1, sizeof(int) * size);
+
+    unsigned mask = size - 1;
+    for (int pos = 0; pos < e->count; pos++)
+    {
+        unsigned i = lsym_hash(e->syms[pos]) & mask;
+        while (e->index[i] >= 0)
+        {
+            i = (i + 1) & mask;
+        }
+        e->index[i] = pos;
+    }
+}
+
+// Lookup a value from the environment
+// Symbols are resolved lexically (current environment, then its parents).
+// Q-expressions passed as code (the branches of 'if', the cases of
+// 'select', ...) are evaluated inside the callee, so symbols that are not
+// bound lexically are then looked up from the active callers outwards.
+// Code run by 'eval' (the cases of 'select' and 'case', the body given to
+// 'let') was written in one of the callers: while it runs in e, the local
+// environments of the callers come before the global environment, so a
+// global does not hide the arguments of the function that wrote it.
+lval *lenv_get(lenv *e, lval *k)
+{
+    int evaluating = e->evals > 0;
+    lenv *global = NULL;
+    for (lenv *scope = e; scope; scope = scope->caller)
+    {
+        // Check the environment, then its parents
+        for (lenv *current_env = scope; current_env; current_env = current_env->parent)
+        {
+            if (evaluating && !current_env->parent)
+            {
+                global = current_env;
+                break;
+            }
+            int pos = lenv_find(current_env, k->sym);
+            if (pos >= 0)
+            {
+                // Return a shared reference to the value if found
+                return lval_ref(current_env->vals[pos]);
+            }
+        }
+    }
+
+    int pos = global ? lenv_find(global, k->sym) : -1;
+    if (pos >= 0)
+    {
+        return lval_ref(global->vals[pos]);
+    }
+
+    // Return error if symbol not found
+    return lval_err("Unbound symbol '%s", k->sym);
+}
+
+// Environment of the lexical chain of e binding sym (NULL if none)
+// *depth is set to the number of parents followed to reach it
+lenv *lenv_locate(lenv *e, char *sym, int *depth)
+{
+    *depth = 0;
+    for (lenv *scope = e; scope; scope = scope->parent, (*depth)++)
+    {
+        if (lenv_find(scope, sym) >= 0)
+        {
+            return scope;
+        }
+    }
+    return NULL;
+}
+
+// Check if lookups from e can never reach x, a frame on its caller chain:
+// every symbol bound in x, and the lexical parents of x, are searched
+// first in one of the frames from e up to x
+int lenv_shadowed(lenv *e, lenv *x)
+{
+    int parent_searched = 0;
+    for (lenv *scope = e; scope != x; scope = scope->caller)
+    {
+        if (scope->parent == x->parent)
+        {
+            parent_searched = 1;
+            break;
+        }
+    }
+    if (!parent_searched)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < x->count; i++)
+    {
+        int found = 0;
+        for (lenv *scope = e; scope != x && !found; scope = scope->caller)
+        {
+            found = lenv_find(scope, x->syms[i]) >= 0;
+        }
+        if (!found)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Release the frames on the caller chain of a new tail call frame (down to
+// base, the environment the evaluation started in) that lookups can no
+// longer reach, e.g. the previous iteration of a tail-recursive loop
+// Only the closest LENV_PRUNE_MAX frames are checked, so a tail call
+// costs O(1)
+void lenv_prune(lenv *frame, lenv *base)
+{
+    lenv **link = &frame->caller;
+    for (int checked = 0; *link != base && checked < LENV_PRUNE_MAX; checked++)
+    {
+        lenv *x = *link;
+        if (lenv_shadowed(frame, x))
+        {
+            *link = x->caller;
+            x->caller = NULL;
+            lenv_del(x);
+        }
+        else
+        {
+            link = &x->caller;
+        }
+    }
+}
+
+// Release the call frames from e up the caller chain to base
+void lenv_unwind(lenv *e, lenv *base)
+{
+    while (e != base)
+    {
+        lenv *caller = e->caller;
+        e->caller = NULL;
+        lenv_del(e);
+        e = caller;
+    }
+}
+
+// Put value into the environment
+void lenv_put(lenv *e, lval *k, lval *v)
+{
+    // A new symbol may shadow positions cached by compiled code. An
+    // environment with a single reference is only the current frame of
+    // the code running in it, which checks its frame itself.
+    if (e->refs > 1 && lenv_find(e, k->sym) < 0)
+    {
+        lenv_epoch++;
+    }
+    lenv_bind(e, k->sym, v);
+}
+
+// Put value into the environment under an interned symbol
+void lenv_bind(lenv *e, char *sym, lval *v)
+{
+    // If existing variable found, delete it and replace by the new one
+    int pos = lenv_find(e, sym);
+    if (pos >= 0)
+    {
+        lval_del(e->vals[pos]);
+        e->vals[pos] = lval_ref(v);
+        return;
+    }
+
+    // If no existing entry found make space for new entry
+    if (e->count == e->capacity)
+    {
+        e->capacity = e->capacity ? e->capacity * 2 : 4;
+        e->vals = realloc(e->vals, sizeof(lval *) * e->capacity);
+        e->syms = realloc(e->syms, sizeof(char *) * e->capacity);
+    }
+
+    // Add the new entry
+    e->vals[e->count] = lval_ref(v);
+    e->syms[e->count] = sym;
+    e->count++;
+
+    if (e->count > LENV_SCAN_MAX && e->count * 2 > e->index_size)
+    {
+        // Index large environments, keeping the index at most half full
+        lenv_reindex(e, e->index_size ? e->index_size * 2 : 4 * LENV_SCAN_MAX);
+    }
+    else if (e->index)
+    {
+        // Add the new position to the existing index
+        unsigned mask = e->index_size - 1;
+        unsigned i = lsym_hash(sym) & mask;
+        while (e->index[i] >= 0)
+        {
+            i = (i + 1) & mask;
+        }
+        e->index[i] = e->count - 1;
+    }
+}
+
+// Define variable in global environment
+void lenv_def(lenv *e, lval *k, lval *v)
+{
+    lenv *current_env = e;
+    while (current_env->parent)
+    {
+        current_env = current_env->parent;
+    }
+    lenv_put(current_env, k, v);
+}
+
+// Register a built-in function
+void lenv_add_builtin(lenv *e, char *name, lbuiltin func)
+{
+    lval *k = lval_sym(name);
+    lval *v = lval_fun(func);
+    lenv_put(e, k, v);
+
+    // Remember the name for images
+    if (!lbuiltin_name(func) && lbuiltin_count < LBUILTIN_MAX)
+    {
+        lbuiltins[lbuiltin_count].name = k->sym;
+        lbuiltins[lbuiltin_count].func = func;
+        lbuiltin_count++;
+    }
+
+    lval_del(k);
+    lval_del(v);
+}
+
+// Handle variable definitions
+lval *builtin_var(lenv *e, lval *args, char *func_name)
+{
+    // First argument is a symbol list
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_QEXPR);
+    lval *syms = args->cell[0];
+    for (int i = 0; i < syms->count; i++)
+    {
+        LASSERT(args, syms->cell[i]->type == LVAL_SYM,
+                "Function 'def' - cannot define non-symbol. Expected %s. Got %s.",
+                ltype_name(LVAL_SYM), ltype_name(syms->cell[i]->type));
+    }
+
+    // The remaining arguments is the value list
+    LASSERT(args, syms->count == args->count - 1,
+            "Function 'def' - number of symbols and values mismatch. ",
+            "Number of symbols: %i. Number of values: %i",
+            syms->count, args->count - 1);
+
+    // Register the variables
+    for (int i = 0; i < syms->count; i++)
+    {
+        if (strcmp(func_name, "def") == 0)
+        {
+            lenv_def(e, syms->cell[i], args->cell[i + 1]);
+        }
+        else if (strcmp(func_name, "=") == 0)
+        {
+            lenv_put(e, syms->cell[i], args->cell[i + 1]);
+        }
+    }
+
+    // Delete 'args' and return an empty expression on success
+    lval_del(args);
+    return lval_sexpr();
+}
+
+// Handle variable definition in global environment
+lval *builtin_def(lenv *e, lval *args)
+{
+    return builtin_var(e, args, "def");
+}
+
+// Handle variable definition in local environment
+lval *builtin_put(lenv *e, lval *args)
+{
+    return builtin_var(e, args, "=");
+}
+
+// Handle lambda function
+lval *builtin_lambda(lenv *e, lval *args)
+{
+    // Validation: 2 Q-expressions as arguments
+    LASSERT_NUM_ARGS("\\", args, 2);
+    LASSERT_ARG_TYPE("\\", args, 0, LVAL_QEXPR);
+    LASSERT_ARG_TYPE("\\", args, 1, LVAL_QEXPR);
+
+    // First Q-expressions (formal arguments) should only contains symbols
+    for (int i = 0; i < args->cell[0]->count; i++)
+    {
+        LASSERT(args, (args->cell[0]->cell[i]->type == LVAL_SYM),
+                "Cannot define non-symbol. Got %s, Expected %s.",
+                ltype_name(args->cell[0]->cell[i]->type),
+                ltype_name(LVAL_SYM));
+    }
+
+    // Create the lambda function
+    lval *formals = lval_pop(args, 0);
+    lval *body = lval_pop(args, 0);
+    lval_del(args);
+
+    // The lambda closes over the environment it is created in
+    return lval_lambda(lenv_ref(e), formals, body);
+}
+
+// Comparision - order
+lval *builtin_gt(lenv *e, lval *args)
+{
+    return builtin_order(e, args, LCMP_GT);
+}
+lval *builtin_ge(lenv *e, lval *args)
+{
+    return builtin_order(e, args, LCMP_GE);
+}
+lval *builtin_lt(lenv *e, lval *args)
+{
+    return builtin_order(e, args, LCMP_LT);
+}
+lval *builtin_le(lenv *e, lval *args)
+{
+    return builtin_order(e, args, LCMP_LE);
+}
+lval *builtin_order(lenv *e, lval *args, int op)
+{
+    char *name = lcmp_names[op];
+    LASSERT_NUM_ARGS(name, args, 2);
+    LASSERT_ARG_NUMBER(name, args, 0);
+    LASSERT_ARG_NUMBER(name, args, 1);
+
+    // Sign of the difference
+    int diff;
+    lval *x = args->cell[0];
+    lval *y = args->cell[1];
+    if (x->type == LVAL_DBL || y->type == LVAL_DBL)
+    {
+        // Compared directly so NaN is unordered
+        double d1 = lval_to_dbl(x);
+        double d2 = lval_to_dbl(y);
+        int result = op == LCMP_GT   ? d1 > d2
+                     : op == LCMP_GE ? d1 >= d2
+                     : op == LCMP_LT ? d1 < d2
+                                     : d1 <= d2;
+        return lval_num_result(args, result);
+    }
+    if (x->type == LVAL_NUM && y->type == LVAL_NUM)
+    {
+        diff = (x->num > y->num) - (x->num < y->num);
+    }
+    else
+    {
+        x = lval_to_big(x);
+        y = lval_to_big(y);
+        diff = lval_big_cmp(x, y);
+        lval_del(x);
+        lval_del(y);
+    }
+
+    int result = 0;
+    switch (op)
+    {
+    case LCMP_GT:
+        result = diff > 0;
+        break;
+    case LCMP_GE:
+        result = diff >= 0;
+        break;
+    case LCMP_LT:
+        result = diff < 0;
+        break;
+    case LCMP_LE:
+        result = diff <= 0;
+        break;
+    }
+
+    return lval_num_result(args, result);
+}
+
+// Comparision - equality
+int lval_eq(lval *x, lval *y)
+{
+    // Floats equal numbers of the same value
+    if ((x->type == LVAL_DBL && lval_is_number(y)) ||
+        (y->type == LVAL_DBL && lval_is_number(x)))
+    {
+        return lval_to_dbl(x) == lval_to_dbl(y);
+    }
+
+    if (x->type != y->type)
+    {
+        return 0;
+    }
+
+    switch (x->type)
+    {
+    case LVAL_NUM:
+        return x->num == y->num;
+    case LVAL_BIG:
+        return lval_big_cmp(x, y) == 0;
+    case LVAL_ERR:
+        return strcmp(x->err, y->err) == 0;
+    case LVAL_SYM:
+        return x->sym == y->sym;
+    case LVAL_STR:
+        return strcmp(x->str, y->str) == 0;
+    case LVAL_FUN:
+        if (x->builtin || y->builtin)
+        {
+            return x->builtin == y->builtin;
+        }
+        return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+    case LVAL_VEC:
+        if (x->count != y->count)
+        {
+            return 0;
+        }
+        for (int i = 0; i < x->count; i++)
+        {
+            if (!lval_eq(x->cell[i], y->cell[i]))
+            {
+                return 0;
+            }
+        }
+        return 1;
+    case LVAL_MAP:
+        // Same keys with equal values, in any order
+        if (x->nentries != y->nentries)
+        {
+            return 0;
+        }
+        lmap_iter it;
+        lmap_iter_init(&it, x);
+        for (lval **entry; (entry = lmap_next(&it));)
+        {
+            lval **slot = lmap_find(y, entry[0]);
+            if (!slot || !lval_eq(entry[1], *slot))
+            {
+                return 0;
+            }
+        }
+        return 1;
+    default:
+        break;
+    }
+    return 0;
+}
+lval *builtin_cmp(lenv *e, lval *args, int op)
+{
+    LASSERT_NUM_ARGS(lcmp_names[op], args, 2);
 
-        lval_del(y);
+    int result = lval_eq(args->cell[0], args->cell[1]);
+    if (op == LCMP_NE)
+    {
+        result = !result;
     }
 
-    lval_del(args);
-    return x;
+    return lval_num_result(args, result);
+}
+lval *builtin_eq(lenv *e, lval *args)
+{
+    return builtin_cmp(e, args, LCMP_EQ);
 }
 
-// Built-in math functions
-lval *builtin_add(lenv *e, lval *args)
+lval *builtin_ne(lenv *e, lval *args)
 {
-    return builtin_op(e, args, "+");
+    return builtin_cmp(e, args, LCMP_NE);
 }
-lval *builtin_sub(lenv *e, lval *args)
+
+// If <then expression> <else expression>
+lval *builtin_if(lenv *e, lval *args)
 {
-    return builtin_op(e, args, "-");
+    lval *branch = lval_if_branch(args);
+    if (branch->type == LVAL_ERR)
+    {
+        return branch;
+    }
+    return lval_eval(e, branch);
 }
-lval *builtin_mul(lenv *e, lval *args)
+
+// Expression of the branch taken by 'if' (or an error), deletes args
+lval *lval_if_branch(lval *args)
 {
-    return builtin_op(e, args, "*");
+    const char *func_name = "if";
+    LASSERT_NUM_ARGS(func_name, args, 3);
+    LASSERT_ARG_NUMBER(func_name, args, 0)           // comparision
+    LASSERT_ARG_TYPE(func_name, args, 1, LVAL_QEXPR) // then clause
+    LASSERT_ARG_TYPE(func_name, args, 2, LVAL_QEXPR) // else clause
+
+    lval *branch;
+    if (lval_is_true(args->cell[0]))
+    {
+        // If the condition is true, take the first expression
+        branch = lval_unshare(lval_pop(args, 1));
+    }
+    else
+    {
+        // Otherwise take the second expression
+        branch = lval_unshare(lval_pop(args, 2));
+    }
+    branch->type = LVAL_SEXPR;
+
+    lval_del(args);
+    return branch;
 }
-lval *builtin_div(lenv *e, lval *args)
+
+// Do <expressions...>
+// The arguments are evaluated in order, the value of the last one is the
+// result (nil without arguments). lval_eval and the VM evaluate the last
+// argument in tail position instead of calling this.
+lval *builtin_do(lenv *e, lval *args)
 {
-    return builtin_op(e, args, "/");
+    if (args->count == 0)
+    {
+        lval_del(args);
+        return lval_qexpr();
+    }
+    return lval_take(args, args->count - 1);
 }
 
-// Takes a Q-Expression and returns a Q-Expression with only the first element
-lval *builtin_head(lenv *e, lval *args)
+// Loading file
+lval *builtin_load(lenv *e, lval *args)
 {
-    const char *func_name = "head";
+    const char *func_name = "load";
     LASSERT_NUM_ARGS(func_name, args, 1);
-    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY(func_name, args, 0);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_STR);
 
-    // Pop the first element and delete args
-    lval *v = lval_take(args, 0);
+    // Map the file into memory
+    char *filename = args->cell[0]->str;
+    lfile file;
+    if (!lfile_open(&file, filename))
+    {
+        lval *err = lval_err("Could not load Library: %s: error: Unable to open file!", filename);
+        lval_del(args);
+        return err;
+    }
 
-    // Delete elements that are not head and return
-    while (v->count > 1)
+    // Evaluate each expression as soon as it is read, so only one is
+    // held in memory at a time
+    lreader r;
+    if (file.data)
     {
-        lval_del(lval_pop(v, 1));
+        lreader_init(&r, filename, file.data, file.len);
     }
-    return v;
+    else
+    {
+        lreader_init_fd(&r, filename, file.fd);
+    }
+
+    lval *result = lenv_load(e, &r);
+    lreader_free(&r);
+    lfile_close(&file);
+    lval_del(args);
+    return result;
 }
 
-// Takes a Q-Expression and returns a Q-Expression with the first element removed
-lval *builtin_tail(lenv *e, lval *args)
+// Evaluate each expression of a reader as soon as it is read
+// Returns an empty list, or the syntax error that stopped loading
+lval *lenv_load(lenv *e, lreader *r)
 {
-    const char *func_name = "tail";
-    LASSERT_NUM_ARGS(func_name, args, 1);
-    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY(func_name, args, 0);
+    lval *v;
+    while ((v = lreader_next(r)))
+    {
+        if (v->type == LVAL_ERR)
+        {
+            // Report the syntax error as a Lisp error, stop loading
+            lval *err = lval_err("Could not load Library: %s", v->err);
+            lval_del(v);
+            return err;
+        }
 
-    // Pop the first element and delete args
-    lval *v = lval_take(args, 0);
+        lval *x = lvm_enabled ? lvm_eval(e, v) : lval_eval(e, v);
 
-    // Delete the first element and return
-    lval_del(lval_pop(v, 0));
-    return v;
-}
+        // If evaluate leads to error, print it
+        if (x->type == LVAL_ERR)
+        {
+            lval_println(x);
+        }
 
-// Returns a new Q-Expression containing the arguments
-lval *builtin_list(lenv *e, lval *args)
-{
-    args->type = LVAL_QEXPR;
-    return args;
+        lval_del(x);
+
+        // Output of a stream shows up as its expressions are evaluated
+        if (r->fd >= 0)
+        {
+            fflush(stdout);
+        }
+    }
+
+    // Return empty list
+    return lval_sexpr();
 }
 
-// Takes a Q-Expression and evaluates it as if it were a S-Expression
-lval *builtin_eval(lenv *e, lval *args)
+// Open a file and map its contents into memory
+// Files that cannot be mapped (pipes, terminals) are left open to be read
+// as a stream instead
+// Returns 0 if the file cannot be opened, or is a directory
+int lfile_open(lfile *f, char *filename)
 {
-    const char *func_name = "eval";
-    LASSERT_NUM_ARGS(func_name, args, 1);
-    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_QEXPR);
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
 
-    lval *v = lval_take(args, 0);
-    v->type = LVAL_SEXPR;
-    return lval_eval(e, v);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || S_ISDIR(st.st_mode))
+    {
+        close(fd);
+        return 0;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+            close(fd);
+            f->data = data;
+            f->len = st.st_size;
+            f->fd = -1;
+            return 1;
+        }
+    }
+
+    f->data = NULL;
+    f->len = 0;
+    f->fd = fd;
+    return 1;
 }
 
-// Returns a Q-Expression by joining Q-Expressions together
-lval *builtin_join(lenv *e, lval *args)
+// Unmap the contents of a file, or close the stream
+void lfile_close(lfile *f)
 {
-    const char *func_name = "join";
-
-    for (int i = 0; i < args->count; i++)
+    if (f->data)
     {
-        LASSERT_ARG_TYPE(func_name, args, i, LVAL_QEXPR);
+        munmap(f->data, f->len);
+    }
+    else
+    {
+        close(f->fd);
     }
+    f->data = NULL;
+    f->fd = -1;
+}
 
-    lval *v = lval_pop(args, 0);
-    while (args->count > 0)
+// Name of a builtin function, NULL if it was never registered
+char *lbuiltin_name(lbuiltin func)
+{
+    for (int i = 0; i < lbuiltin_count; i++)
     {
-        v = lval_join(v, lval_pop(args, 0));
+        if (lbuiltins[i].func == func)
+        {
+            return lbuiltins[i].name;
+        }
     }
+    return NULL;
+}
 
-    lval_del(args);
-    return v;
+// Builtin function registered under an interned name, NULL if none
+lbuiltin lbuiltin_find(char *name)
+{
+    for (int i = 0; i < lbuiltin_count; i++)
+    {
+        if (lbuiltins[i].name == name)
+        {
+            return lbuiltins[i].func;
+        }
+    }
+    return NULL;
 }
 
-// Helper for builtin_join - join 2 Q-Expressions together
-lval *lval_join(lval *x, lval *y)
+// Start writing a file: its magic string, then the version
+// Returns 0 if the file can not be created
+int lser_create(lser *s, char *filename, char *magic)
 {
-    // Append all elements from y to x
-    while (y->count > 0)
+    *s = (lser){0};
+    FILE *f = fopen(filename, "wb");
+    if (!f)
     {
-        x = lval_add(x, lval_pop(y, 0));
+        return 0;
     }
+    lwriter_init(&s->out, f);
+    lwriter_str(&s->out, magic);
+    lser_byte(s, LSER_VERSION);
+    return 1;
+}
 
-    // Delete the empty y and return x
-    lval_del(y);
-    return x;
+// Write out the rest of a file and release the serializer
+// Returns an error message if anything could not be written, NULL otherwise
+char *lser_commit(lser *s)
+{
+    FILE *f = s->out.out;
+    lwriter_flush(&s->out);
+    int ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    char *error = s->error ? s->error : ok ? NULL : "Unable to write file!";
+    lser_free(s);
+    return error;
 }
 
-// Create new environment
-lenv *lenv_new()
+// Append a byte to the output
+void lser_byte(lser *s, int b)
 {
-    lenv *e = malloc(sizeof(lenv));
-    e->parent = NULL;
-    e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
-    return e;
+    lwriter_char(&s->out, (char)b);
 }
 
-// Delete an environment
-void lenv_del(lenv *e)
+// Append an unsigned number (LEB128 varint: 7 bits per byte, the high bit
+// marks that more bytes follow)
+void lser_uint(lser *s, unsigned long x)
 {
-    for (int i = 0; i < e->count; i++)
+    while (x >= 0x80)
     {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+        lser_byte(s, (int)(x & 0x7f) | 0x80);
+        x >>= 7;
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    lser_byte(s, (int)x);
 }
 
-// Lookup a value from the environment
-lval *lenv_get(lenv *e, lval *k)
+// Append a signed number (zigzag encoded, so small negatives stay short)
+void lser_int(lser *s, long x)
 {
-    for (int i = 0; i < e->count; i++)
+    lser_uint(s, ((unsigned long)x << 1) ^ (x < 0 ? ~0UL : 0));
+}
+
+// Append a length followed by that many bytes
+void lser_bytes(lser *s, char *p, long len)
+{
+    lser_uint(s, len);
+    lwriter_mem(&s->out, p, len);
+}
+
+// Number of an object already written, or -1 after numbering it with the
+// next number of its kind (next points at s->count or s->nsyms)
+int lser_number(lser *s, void *p, int *next)
+{
+    // Keep the table at most half full
+    if ((s->count + s->nsyms + 1) * 2 > s->size)
     {
-        // Return a copy of the value if found
-        if (strcmp(e->syms[i], k->sym) == 0)
+        int size = s->size ? s->size * 2 : 64;
+        uintptr_t *keys = calloc(size, sizeof(uintptr_t));
+        int *ids = malloc(sizeof(int) * size);
+        for (int i = 0; i < s->size; i++)
         {
-            return lval_copy(e->vals[i]);
+            if (s->keys[i])
+            {
+                unsigned j = lsym_hash((char *)s->keys[i]) & (size - 1);
+                while (keys[j])
+                {
+                    j = (j + 1) & (size - 1);
+                }
+                keys[j] = s->keys[i];
+                ids[j] = s->ids[i];
+            }
         }
+        free(s->keys);
+        free(s->ids);
+        s->keys = keys;
+        s->ids = ids;
+        s->size = size;
     }
 
-    if (e->parent)
+    // Linear probing until the address or an empty slot is found
+    unsigned i = lsym_hash(p) & (s->size - 1);
+    while (s->keys[i])
+    {
+        if (s->keys[i] == (uintptr_t)p)
+        {
+            return s->ids[i];
+        }
+        i = (i + 1) & (s->size - 1);
+    }
+    s->keys[i] = (uintptr_t)p;
+    s->ids[i] = (*next)++;
+    return -1;
+}
+
+// Write an interned symbol: its name the first time, then its number
+void lser_write_sym(lser *s, char *sym)
+{
+    int id = lser_number(s, sym, &s->nsyms);
+    lser_uint(s, id + 1);
+    if (id < 0)
     {
-        // Check in parent environment
-        return lenv_get(e->parent, k);
+        lser_bytes(s, sym, strlen(sym));
     }
-    else
+}
+
+// Write a value
+// Past LSER_DEPTH_MAX levels of nesting, nothing more is written and
+// s->error is set
+void lser_write(lser *s, lval *v)
+{
+    if (s->depth >= LSER_DEPTH_MAX)
+    {
+        s->error = "nesting too deep";
+    }
+    if (s->error)
     {
-        // Return error if symbol not found
-        return lval_err("Unbound symbol '%s", k->sym);
+        return;
     }
+    s->depth++;
+    lser_write_value(s, v);
+    s->depth--;
 }
 
-// Put value into the environment
-void lenv_put(lenv *e, lval *k, lval *v)
+// Write a value, for lser_write
+void lser_write_value(lser *s, lval *v)
 {
-    for (int i = 0; i < e->count; i++)
+    // Lists and functions with more than one reference are numbered, and
+    // referred to by number after the first time. The others can only be
+    // reached once, so they are not looked up.
+    int shared = (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR ||
+                  v->type == LVAL_VEC || v->type == LVAL_MAP ||
+                  (v->type == LVAL_FUN && !v->builtin)) &&
+                 v->refs > 1;
+    if (shared)
     {
-        // If existing variable found, delete it and replace by the new one
-        if (strcmp(e->syms[i], k->sym) == 0)
+        int id = lser_number(s, v, &s->count);
+        if (id >= 0)
         {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
+            lser_byte(s, LSER_REF);
+            lser_uint(s, id);
             return;
         }
+        lser_byte(s, LSER_SHARED);
     }
 
-    // If no existing entry found allocate space for new entry
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-    e->syms = realloc(e->syms, sizeof(char *) * e->count);
-
-    // Add the new entry
-    e->vals[e->count - 1] = lval_copy(v);
-    e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count - 1], k->sym);
+    switch (v->type)
+    {
+    case LVAL_NUM:
+        lser_byte(s, LSER_NUM);
+        lser_int(s, v->num);
+        break;
+    case LVAL_BIG:
+        lser_byte(s, LSER_BIG);
+        lser_byte(s, v->neg);
+        lser_uint(s, v->nlimbs);
+        for (int i = 0; i < v->nlimbs; i++)
+        {
+            lser_uint(s, v->limbs[i]);
+        }
+        break;
+    case LVAL_DBL:
+    {
+        // The bits of the double, least significant byte first
+        uint64_t bits;
+        memcpy(&bits, &v->dbl, sizeof(bits));
+        lser_byte(s, LSER_DBL);
+        for (int i = 0; i < 8; i++)
+        {
+            lser_byte(s, (int)(bits >> (8 * i)) & 0xff);
+        }
+        break;
+    }
+    case LVAL_ERR:
+        lser_byte(s, LSER_ERR);
+        lser_bytes(s, v->err, strlen(v->err));
+        break;
+    case LVAL_SYM:
+        lser_byte(s, LSER_SYM);
+        lser_write_sym(s, v->sym);
+        break;
+    case LVAL_STR:
+        lser_byte(s, LSER_STR);
+        lser_bytes(s, v->str, strlen(v->str));
+        break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+    case LVAL_VEC:
+        lser_byte(s, v->type == LVAL_SEXPR   ? LSER_SEXPR
+                     : v->type == LVAL_QEXPR ? LSER_QEXPR
+                                             : LSER_VEC);
+        lser_uint(s, v->count);
+        for (int i = 0; i < v->count; i++)
+        {
+            lser_write(s, v->cell[i]);
+        }
+        break;
+    case LVAL_MAP:
+        lser_byte(s, LSER_MAP);
+        lser_uint(s, v->nentries);
+        lmap_iter it;
+        lmap_iter_init(&it, v);
+        for (lval **entry; (entry = lmap_next(&it));)
+        {
+            lser_write(s, entry[0]);
+            lser_write(s, entry[1]);
+        }
+        break;
+    case LVAL_FUN:
+        if (v->builtin)
+        {
+            // Builtins are written by the name they were registered under
+            char *name = lbuiltin_name(v->builtin);
+            lser_byte(s, LSER_BUILTIN);
+            lser_write_sym(s, name ? name : lsym_intern(""));
+        }
+        else
+        {
+            lser_byte(s, LSER_LAMBDA);
+            lser_write_env(s, v->env);
+            lser_write(s, v->formals);
+            lser_write(s, v->body);
+        }
+        break;
+    }
 }
 
-// Define variable in global environment
-void lenv_def(lenv *e, lval *k, lval *v)
+// Write an environment (NULL is written as LSER_NONE)
+// The caller of a call frame is not part of it
+void lser_write_env(lser *s, lenv *e)
 {
-    lenv *current_env = e;
-    while (current_env->parent)
+    if (!e)
     {
-        current_env = current_env->parent;
+        lser_byte(s, LSER_NONE);
+        return;
     }
-    lenv_put(current_env, k, v);
+    if (e == s->root)
+    {
+        lser_byte(s, LSER_GLOBAL);
+        return;
+    }
+
+    int id = lser_number(s, e, &s->count);
+    if (id >= 0)
+    {
+        lser_byte(s, LSER_REF);
+        lser_uint(s, id);
+        return;
+    }
+
+    // Parents count as nesting (see lser_read_env)
+    if (s->depth >= LSER_DEPTH_MAX)
+    {
+        s->error = "nesting too deep";
+        return;
+    }
+    lser_byte(s, LSER_ENV);
+    s->depth++;
+    lser_write_env(s, e->parent);
+    s->depth--;
+    lser_write_bindings(s, e);
 }
 
-// Register a built-in function
-void lenv_add_builtin(lenv *e, char *name, lbuiltin func)
+// Write the number of bindings of an environment, then each symbol and value
+void lser_write_bindings(lser *s, lenv *e)
 {
-    lval *k = lval_sym(name);
-    lval *v = lval_fun(func);
-    lenv_put(e, k, v);
-    lval_del(k);
-    lval_del(v);
+    lser_uint(s, e->count);
+    for (int i = 0; i < e->count; i++)
+    {
+        lser_write_sym(s, e->syms[i]);
+        lser_write(s, e->vals[i]);
+    }
 }
 
-// Create a copy of an environment
-lenv *lenv_copy(lenv *e)
+// Start reading a file: map it and check its magic string and version
+// Returns an error message, or NULL once the file is open (see lser_close)
+char *lser_open(lser *s, char *filename, char *magic)
 {
-    lenv *new_env = malloc(sizeof(lenv));
-    new_env->parent = e->parent;
-    new_env->count = e->count;
-
-    new_env->syms = malloc(sizeof(char *) * new_env->count);
-    new_env->vals = malloc(sizeof(lval *) * new_env->count);
-
-    for (int i = 0; i < e->count; i++)
+    *s = (lser){0};
+    if (!lfile_open(&s->file, filename))
     {
-        new_env->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(new_env->syms[i], e->syms[i]);
-        new_env->vals[i] = lval_copy(e->vals[i]);
+        return "Unable to open file!";
     }
+    if (!s->file.data)
+    {
+        lfile_close(&s->file);
+        return "Not a regular file";
+    }
+    s->pos = s->file.data;
+    s->end = s->file.data + s->file.len;
 
-    return new_env;
+    long magic_len = strlen(magic);
+    if (s->file.len <= magic_len || memcmp(s->file.data, magic, magic_len) != 0)
+    {
+        lser_fail(s, "Wrong file format");
+    }
+    else if (s->file.data[magic_len] != LSER_VERSION)
+    {
+        lser_fail(s, "Unsupported version");
+    }
+    s->pos += magic_len + 1;
+    return NULL;
 }
 
-// Handle variable definitions
-lval *builtin_var(lenv *e, lval *args, char *func_name)
+// Check that all of the file was read, release it and the serializer
+// Returns the first error, NULL if there was none
+char *lser_close(lser *s)
 {
-    // First argument is a symbol list
-    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_QEXPR);
-    lval *syms = args->cell[0];
-    for (int i = 0; i < syms->count; i++)
+    if (!s->error && s->pos != s->end)
+    {
+        lser_fail(s, "Data after the end");
+    }
+    char *error = s->error;
+    lser_free(s);
+    lfile_close(&s->file);
+    return error;
+}
+
+// Stop reading with an error (the first one is kept)
+void lser_fail(lser *s, char *msg)
+{
+    if (!s->error)
     {
-        LASSERT(args, syms->cell[i]->type == LVAL_SYM,
-                "Function 'def' - cannot define non-symbol. Expected %s. Got %s.",
-                ltype_name(LVAL_SYM), ltype_name(syms->cell[i]->type));
+        s->error = msg;
     }
+    s->pos = s->end;
+}
 
-    // The remaining arguments is the value list
-    LASSERT(args, syms->count == args->count - 1,
-            "Function 'def' - number of symbols and values mismatch. ",
-            "Number of symbols: %i. Number of values: %i",
-            syms->count, args->count - 1);
+// Read a byte, 0 past the end of the input
+int lser_get_byte(lser *s)
+{
+    if (s->pos >= s->end)
+    {
+        lser_fail(s, "unexpected end of data");
+        return 0;
+    }
+    return (unsigned char)*s->pos++;
+}
 
-    // Register the variables
-    for (int i = 0; i < syms->count; i++)
+// Read an unsigned number
+unsigned long lser_get_uint(lser *s)
+{
+    unsigned long x = 0;
+    for (int shift = 0; shift < 64; shift += 7)
     {
-        if (strcmp(func_name, "def") == 0)
-        {
-            lenv_def(e, syms->cell[i], args->cell[i + 1]);
-        }
-        else if (strcmp(func_name, "=") == 0)
+        int b = lser_get_byte(s);
+        x |= (unsigned long)(b & 0x7f) << shift;
+        if (!(b & 0x80))
         {
-            lenv_put(e, syms->cell[i], args->cell[i + 1]);
+            return x;
         }
     }
-
-    // Delete 'args' and return an empty expression on success
-    lval_del(args);
-    return lval_sexpr();
+    lser_fail(s, "number too large");
+    return 0;
 }
 
-// Handle variable definition in global environment
-lval *builtin_def(lenv *e, lval *args)
+// Read a signed number
+long lser_get_int(lser *s)
 {
-    return builtin_var(e, args, "def");
+    unsigned long x = lser_get_uint(s);
+    return (long)(x >> 1) ^ -(long)(x & 1);
 }
 
-// Handle variable definition in local environment
-lval *builtin_put(lenv *e, lval *args)
+// Read a length, checking that at least min_size bytes per unit remain
+long lser_get_len(lser *s, int min_size)
 {
-    return builtin_var(e, args, "=");
+    unsigned long len = lser_get_uint(s);
+    if (len > (unsigned long)(s->end - s->pos) / min_size)
+    {
+        lser_fail(s, "length past the end of data");
+        return 0;
+    }
+    return (long)len;
 }
 
-// Handle lambda function
-lval *builtin_lambda(lenv *e, lval *args)
+// Read a length followed by that many bytes, pointing into the input
+char *lser_get_bytes(lser *s, long *len)
 {
-    // Validation: 2 Q-expressions as arguments
-    LASSERT_NUM_ARGS("\\", args, 2);
-    LASSERT_ARG_TYPE("\\", args, 0, LVAL_QEXPR);
-    LASSERT_ARG_TYPE("\\", args, 1, LVAL_QEXPR);
+    *len = lser_get_len(s, 1);
+    char *p = s->pos;
+    s->pos += *len;
+    return p;
+}
 
-    // First Q-expressions (formal arguments) should only contains symbols
-    for (int i = 0; i < args->cell[0]->count; i++)
+// Read a symbol, NULL (after failing) for an unknown number
+char *lser_get_sym(lser *s)
+{
+    unsigned long id = lser_get_uint(s);
+    if (id > 0)
     {
-        LASSERT(args, (args->cell[0]->cell[i]->type == LVAL_SYM),
-                "Cannot define non-symbol. Got %s, Expected %s.",
-                ltype_name(args->cell[0]->cell[i]->type),
-                ltype_name(LVAL_SYM));
+        if (id > (unsigned long)s->nsyms)
+        {
+            lser_fail(s, "invalid symbol");
+            return NULL;
+        }
+        return s->syms[id - 1];
     }
 
-    // Create the lambda function
-    lval *formals = lval_pop(args, 0);
-    lval *body = lval_pop(args, 0);
-    lval_del(args);
-
-    return lval_lambda(formals, body);
+    long len;
+    char *p = lser_get_bytes(s, &len);
+    if (s->nsyms == s->syms_size)
+    {
+        s->syms_size = s->syms_size ? s->syms_size * 2 : 64;
+        s->syms = realloc(s->syms, sizeof(char *) * s->syms_size);
+    }
+    return s->syms[s->nsyms++] = lsym_intern_len(p, len);
 }
 
-// Comparision - order
-lval *builtin_gt(lenv *e, lval *args)
-{
-    return builtin_order(e, args, ">");
-}
-lval *builtin_ge(lenv *e, lval *args)
+// Keep a new object by number, with the low bit tagging environments
+// The table holds a reference, dropped by lser_free
+void lser_add(lser *s, void *p, int is_env)
 {
-    return builtin_order(e, args, ">=");
+    if (s->count == s->size)
+    {
+        s->size = s->size ? s->size * 2 : 64;
+        s->keys = realloc(s->keys, sizeof(uintptr_t) * s->size);
+    }
+    s->keys[s->count++] = (uintptr_t)p | is_env;
 }
-lval *builtin_lt(lenv *e, lval *args)
+
+// Object kept under the number read next, NULL (after failing) if there
+// is no such object of the expected kind
+// A list can only contain itself through a function (a list without
+// functions in it would be a cycle no environment could free)
+void *lser_get_ref(lser *s, int is_env)
 {
-    return builtin_order(e, args, "<");
+    unsigned long id = lser_get_uint(s);
+    if (id >= (unsigned long)s->count || (int)(s->keys[id] & 1) != is_env ||
+        ((s->keys[id] & 2) && (int)id >= s->barrier))
+    {
+        lser_fail(s, "invalid reference");
+        return NULL;
+    }
+    return (void *)(s->keys[id] & ~(uintptr_t)3);
 }
-lval *builtin_le(lenv *e, lval *args)
+
+// Read a value
+// After an error the value is a placeholder (and s->error is set)
+lval *lser_read(lser *s)
 {
-    return builtin_order(e, args, "<=");
+    if (s->depth >= LSER_DEPTH_MAX)
+    {
+        lser_fail(s, "nesting too deep");
+        return lval_sexpr();
+    }
+    s->depth++;
+    lval *x = lser_read_value(s);
+    s->depth--;
+    return x;
 }
-lval *builtin_order(lenv *e, lval *args, char *op)
-{
-    LASSERT_NUM_ARGS(op, args, 2);
-    LASSERT_ARG_TYPE(op, args, 0, LVAL_NUM);
 
-    int result;
-    int num1 = args->cell[0]->num;
-    int num2 = args->cell[1]->num;
-    if (strcmp(op, ">") == 0)
+// Read a value, for lser_read
+lval *lser_read_value(lser *s)
+{
+    long len;
+    char *p;
+    lval *x;
+    int tag = lser_get_byte(s);
+    int shared = tag == LSER_SHARED;
+    if (shared)
     {
-        result = num1 > num2;
+        tag = lser_get_byte(s);
     }
-    else if (strcmp(op, ">=") == 0)
+    switch (tag)
     {
-        result = num1 >= num2;
+    case LSER_NUM:
+        return lval_num(lser_get_int(s));
+    case LSER_BIG:
+    {
+        int neg = lser_get_byte(s) != 0;
+        int n = lser_get_len(s, 1);
+        x = lval_big(neg, n);
+        for (int i = 0; i < n; i++)
+        {
+            x->limbs[i] = (uint32_t)lser_get_uint(s);
+        }
+        return lval_big_norm(x);
     }
-    else if (strcmp(op, "<") == 0)
+    case LSER_DBL:
     {
-        result = num1 < num2;
+        uint64_t bits = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            bits |= (uint64_t)lser_get_byte(s) << (8 * i);
+        }
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        return lval_dbl(d);
     }
-    else if (strcmp(op, "<=") == 0)
+    case LSER_ERR:
+        p = lser_get_bytes(s, &len);
+        x = lval_str_len(p, len);
+        x->type = LVAL_ERR;
+        return x;
+    case LSER_SYM:
+        p = lser_get_sym(s);
+        return p ? lval_sym(p) : lval_sexpr();
+    case LSER_STR:
+        p = lser_get_bytes(s, &len);
+        return lval_str_len(p, len);
+    case LSER_SEXPR:
+    case LSER_QEXPR:
+    case LSER_VEC:
     {
-        result = num1 <= num2;
+        x = tag == LSER_SEXPR   ? lval_sexpr()
+            : tag == LSER_QEXPR ? lval_qexpr()
+                                : lval_vec();
+        int id = s->count;
+        if (shared)
+        {
+            lser_add(s, lval_ref(x), 0);
+            s->keys[id] |= 2;
+        }
+        int count = lser_get_len(s, 1);
+        lval_reserve(x, count);
+        for (int i = 0; i < count; i++)
+        {
+            lval_add(x, lser_read(s));
+        }
+        if (shared)
+        {
+            s->keys[id] &= ~(uintptr_t)2;
+        }
+        return x;
     }
-
-    lval_del(args);
-    return lval_num(result);
-}
-
-// Comparision - equality
-int lval_eq(lval *x, lval *y)
-{
-    if (x->type != y->type)
+    case LSER_MAP:
     {
-        return 0;
+        // Numbered and guarded against containing itself like a list
+        x = lval_map();
+        int id = s->count;
+        if (shared)
+        {
+            lser_add(s, lval_ref(x), 0);
+            s->keys[id] |= 2;
+        }
+        int count = lser_get_len(s, 2);
+        for (int i = 0; i < count; i++)
+        {
+            lval *k = lser_read(s);
+            lmap_put(x, k, lser_read(s));
+        }
+        if (shared)
+        {
+            s->keys[id] &= ~(uintptr_t)2;
+        }
+        return x;
     }
-
-    switch (x->type)
+    case LSER_BUILTIN:
     {
-    case LVAL_NUM:
-        return x->num == y->num;
-    case LVAL_ERR:
-        return strcmp(x->err, y->err) == 0;
-    case LVAL_SYM:
-        return strcmp(x->sym, y->sym) == 0;
-    case LVAL_STR:
-        return strcmp(x->str, y->str) == 0;
-    case LVAL_FUN:
-        if (x->builtin || y->builtin)
+        p = lser_get_sym(s);
+        lbuiltin func = p ? lbuiltin_find(p) : NULL;
+        if (!func)
         {
-            return x->builtin == y->builtin;
+            lser_fail(s, "unknown builtin");
+            return lval_sexpr();
         }
-        return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
-    case LVAL_QEXPR:
-    case LVAL_SEXPR:
-        if (x->count != y->count)
+        return lval_fun(func);
+    }
+    case LSER_LAMBDA:
+    {
+        // Numbered before its environment, which may refer back to it.
+        // It stays a builtin until it is complete, so it can be deleted
+        // at any point.
+        x = lval_fun(builtin_lambda);
+        if (shared)
         {
-            return 0;
+            lser_add(s, lval_ref(x), 0);
         }
-        for (int i = 0; i < x->count; i++)
+        int barrier = s->barrier;
+        s->barrier = s->count;
+        lenv *env = lser_read_env(s);
+        lval *formals = lser_read(s);
+        lval *body = lser_read(s);
+        s->barrier = barrier;
+        if (!env || formals->type != LVAL_QEXPR || body->type != LVAL_QEXPR)
         {
-            if (!lval_eq(x->cell[i], y->cell[i]))
+            lser_fail(s, "invalid function");
+        }
+        if (s->error)
+        {
+            if (env)
             {
-                return 0;
+                lenv_del(env);
             }
+            lval_del(formals);
+            lval_del(body);
+            return x;
         }
-        return 1;
+        x->builtin = NULL;
+        x->env = env;
+        x->formals = formals;
+        x->body = body;
+        x->code = NULL;
+        return x;
+    }
+    case LSER_REF:
+        x = lser_get_ref(s, 0);
+        return x ? lval_ref(x) : lval_sexpr();
     default:
-        break;
+        lser_fail(s, "invalid tag");
+        return lval_sexpr();
     }
-    return 0;
 }
-lval *builtin_cmp(lenv *e, lval *args, char *op)
+
+// Read an environment, NULL for LSER_NONE (or after an error)
+lenv *lser_read_env(lser *s)
 {
-    LASSERT_NUM_ARGS(op, args, 2);
+    int tag = lser_get_byte(s);
+    if (tag == LSER_NONE)
+    {
+        return NULL;
+    }
+    if (tag == LSER_GLOBAL)
+    {
+        return lenv_ref(s->root);
+    }
+    if (tag == LSER_REF)
+    {
+        lenv *e = lser_get_ref(s, 1);
+        return e ? lenv_ref(e) : NULL;
+    }
+    if (tag != LSER_ENV)
+    {
+        lser_fail(s, "invalid environment");
+        return NULL;
+    }
 
-    int result;
-    lval *x = args->cell[0];
-    lval *y = args->cell[1];
-    if (strcmp(op, "==") == 0)
+    lenv *e = lenv_new();
+    lser_add(s, e, 1);
+
+    // An environment can not be its own ancestor. Its parents count as
+    // nesting like the elements of a list.
+    lenv *parent = NULL;
+    if (s->depth >= LSER_DEPTH_MAX)
+    {
+        lser_fail(s, "nesting too deep");
+    }
+    else
+    {
+        s->depth++;
+        parent = lser_read_env(s);
+        s->depth--;
+    }
+    for (lenv *p = parent; p; p = p->parent)
+    {
+        if (p == e)
+        {
+            lser_fail(s, "invalid environment");
+        }
+    }
+    if (parent && s->error)
     {
-        result = lval_eq(x, y);
+        lenv_del(parent);
     }
-    else if (strcmp(op, "!=") == 0)
+    else
     {
-        result = !lval_eq(x, y);
+        e->parent = parent;
     }
 
-    lval_del(args);
-    return lval_num(result);
-}
-lval *builtin_eq(lenv *e, lval *args)
-{
-    return builtin_cmp(e, args, "==");
+    lser_read_bindings(s, e);
+    return lenv_ref(e);
 }
 
-lval *builtin_ne(lenv *e, lval *args)
+// Read bindings into an environment
+void lser_read_bindings(lser *s, lenv *e)
 {
-    return builtin_cmp(e, args, "!=");
+    int count = lser_get_len(s, 2);
+    for (int i = 0; i < count && !s->error; i++)
+    {
+        char *sym = lser_get_sym(s);
+        lval *v = lser_read(s);
+        if (sym)
+        {
+            lenv_bind(e, sym, v);
+        }
+        lval_del(v);
+    }
 }
 
-// If <then expression> <else expression>
-lval *builtin_if(lenv *e, lval *args)
+// Free the buffers of a serializer and drop the objects kept while reading
+void lser_free(lser *s)
 {
-    const char *func_name = "if";
-    LASSERT_NUM_ARGS(func_name, args, 3);
-    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_NUM)   // comparision
-    LASSERT_ARG_TYPE(func_name, args, 1, LVAL_QEXPR) // then clause
-    LASSERT_ARG_TYPE(func_name, args, 2, LVAL_QEXPR) // else clause
-
-    lval *result;
-    if (args->cell[0]->num)
+    if (s->ids)
     {
-        // If the condition is true, evaluate the first expression
-        lval *thenExpr = lval_pop(args, 1);
-        thenExpr->type = LVAL_SEXPR;
-        result = lval_eval(e, thenExpr);
+        // Written: the table only holds addresses
+        free(s->ids);
     }
     else
     {
-        // Otherwise evaluate the second expression
-        lval *elseExpr = lval_pop(args, 2);
-        elseExpr->type = LVAL_SEXPR;
-        result = lval_eval(e, elseExpr);
+        for (int i = 0; i < s->count; i++)
+        {
+            if (s->keys[i] & 1)
+            {
+                lenv_del((lenv *)(s->keys[i] & ~(uintptr_t)1));
+            }
+            else
+            {
+                lval_del((lval *)(s->keys[i] & ~(uintptr_t)3));
+            }
+        }
     }
+    free(s->keys);
+    free(s->syms);
+    lwriter_free(&s->out);
+}
 
-    lval_del(args);
-    return result;
+// Write the global environment to an image file
+// Returns an error, or an empty list
+lval *limage_dump(lenv *e, char *filename)
+{
+    lser s;
+    if (!lser_create(&s, filename, LIMAGE_MAGIC))
+    {
+        return lval_err("Could not dump image: %s: error: Unable to open file!", filename);
+    }
+    s.root = e;
+    lser_write_bindings(&s, e);
+    char *error = lser_commit(&s);
+    if (error)
+    {
+        return lval_err("Could not dump image: %s: error: %s", filename, error);
+    }
+    return lval_sexpr();
 }
 
-// Loading file
-lval *builtin_load(lenv *e, lval *args)
+// Load the bindings of an image file into the global environment
+// Returns an error, or an empty list
+lval *limage_load(lenv *e, char *filename)
 {
-    const char *func_name = "load";
-    LASSERT_NUM_ARGS(func_name, args, 1);
-    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_STR);
+    lser s;
+    char *error = lser_open(&s, filename, LIMAGE_MAGIC);
+    if (!error)
+    {
+        s.root = e;
+        lser_read_bindings(&s, e);
+        error = lser_close(&s);
+
+        // Bindings were added without lenv_put
+        lenv_epoch++;
+    }
+    return error ? lval_err("Could not load image: %s: error: %s", filename, error)
+                 : lval_sexpr();
+}
 
-    mpc_result_t r;
-    if (mpc_parse_contents(args->cell[0]->str, Lispy, &r))
+// Global environment of an environment (the end of its lexical parents)
+lenv *lenv_global(lenv *e)
+{
+    while (e->parent)
     {
-        // Read contents
-        lval *expr = lval_read(r.output);
-        mpc_ast_delete(r.output);
+        e = e->parent;
+    }
+    return e;
+}
 
-        // Evaluate each expression
-        while (expr->count)
-        {
-            lval *x = lval_eval(e, lval_pop(expr, 0));
+// Write a value to a file, to be read back with deserialize
+// Functions keep the environments they close over, up to the global
+// environment, which is not written
+lval *builtin_serialize(lenv *e, lval *args)
+{
+    const char *func_name = "serialize";
+    LASSERT_NUM_ARGS(func_name, args, 2);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_STR);
 
-            // If evaluate leads to error, print it
-            if (x->type == LVAL_ERR)
-            {
-                lval_println(x);
-            }
+    char *filename = args->cell[0]->str;
+    lser s;
+    LASSERT(args, lser_create(&s, filename, LSER_MAGIC),
+            "Could not serialize: %s: error: Unable to open file!", filename);
+    s.root = lenv_global(e);
+    lser_write(&s, args->cell[1]);
+    char *error = lser_commit(&s);
+    LASSERT(args, !error, "Could not serialize: %s: error: %s", filename, error);
 
-            lval_del(x);
-        }
+    lval_del(args);
+    return lval_sexpr();
+}
 
-        // Delete expressions and arguments
-        lval_del(expr);
-        lval_del(args);
+// Read a value written by serialize
+// Functions in it close over the global environment of the reader
+lval *builtin_deserialize(lenv *e, lval *args)
+{
+    const char *func_name = "deserialize";
+    LASSERT_NUM_ARGS(func_name, args, 1);
+    LASSERT_ARG_TYPE(func_name, args, 0, LVAL_STR);
 
-        // Return empty list
-        return lval_sexpr();
-    }
-    else
+    char *filename = args->cell[0]->str;
+    lser s;
+    char *error = lser_open(&s, filename, LSER_MAGIC);
+    LASSERT(args, !error, "Could not deserialize: %s: error: %s", filename, error);
+    s.root = lenv_global(e);
+    lval *x = lser_read(&s);
+    error = lser_close(&s);
+    if (error)
     {
-        // Get parser error as string
-        char *err_msg = mpc_err_string(r.error);
-        mpc_err_delete(r.error);
+        lval_del(x);
+        x = lval_err("Could not deserialize: %s: error: %s", filename, error);
+    }
 
-        // Create Lisp error
-        lval *err = lval_err("Could not load Library: %s", err_msg);
+    // Symbols may have been added to environments without lenv_put
+    lenv_epoch++;
 
-        // Cleanup and return Lisp error
-        free(err_msg);
-        lval_del(args);
-        return err;
-    }
+    lval_del(args);
+    return x;
 }
 
 // Print all arguments
+// The line is written out at once
 lval *builtin_print(lenv *e, lval *args)
 {
     // Print each arguments followed by a space
+    lwriter w;
+    lwriter_init(&w, stdout);
     for (int i = 0; i < args->count; i++)
     {
-        lval_print(args->cell[i]);
-        putchar(' ');
+        lval_write(&w, args->cell[i]);
+        lwriter_char(&w, ' ');
     }
 
     // Print a newline and delete arguments
-    putchar('\n');
+    lwriter_char(&w, '\n');
+    lwriter_flush(&w);
+    lwriter_free(&w);
     lval_del(args);
 
     return lval_sexpr();
 }
 
+// Printed representation of a value, as a string
+lval *builtin_to_string(lenv *e, lval *args)
+{
+    const char *func_name = "to-string";
+    LASSERT_NUM_ARGS(func_name, args, 1);
+
+    lwriter w;
+    lwriter_init(&w, NULL);
+    lval_write(&w, args->cell[0]);
+    lval *x = lval_str_len(w.data, w.len);
+    lwriter_free(&w);
+
+    lval_del(args);
+    return x;
+}
+
 // Print the provided string as an error
 lval *builtin_error(lenv *e, lval *args)
 {
@@ -1456,6 +7183,43 @@ lval *builtin_error(lenv *e, lval *args)
     return err;
 }
 
+// Statistics of the cycle collector and the heap
+// Arguments are ignored, call it with a placeholder: (gc-stats ())
+lval *builtin_gc_stats(lenv *e, lval *args)
+{
+    long cells = 0;
+    for (int i = 0; i < LCELL_CLASSES; i++)
+    {
+        cells += heap.cells[i].live * heap.cells[i].size;
+    }
+
+    struct
+    {
+        char *name;
+        long value;
+    } stats[] = {
+        {"collections", gc.collections},
+        {"reclaimed-envs", gc.reclaimed},
+        {"pause-total-us", gc.pause_total},
+        {"pause-max-us", gc.pause_max},
+        {"live-values", heap.lvals.live},
+        {"live-envs", heap.lenvs.live},
+        {"heap-bytes", heap.lvals.live * heap.lvals.size +
+                           heap.lenvs.live * heap.lenvs.size + cells},
+    };
+
+    // {{name value} ...}
+    lval *result = lval_qexpr();
+    for (size_t i = 0; i < sizeof(stats) / sizeof(stats[0]); i++)
+    {
+        lval *pair = lval_add(lval_qexpr(), lval_sym(stats[i].name));
+        result = lval_add(result, lval_add(pair, lval_num(stats[i].value)));
+    }
+
+    lval_del(args);
+    return result;
+}
+
 // Register all built-in functions
 void lenv_add_builtins(lenv *e)
 {
@@ -1465,6 +7229,31 @@ void lenv_add_builtins(lenv *e)
     lenv_add_builtin(e, "tail", builtin_tail);
     lenv_add_builtin(e, "eval", builtin_eval);
     lenv_add_builtin(e, "join", builtin_join);
+    lenv_add_builtin(e, "len", builtin_len);
+    lenv_add_builtin(e, "nth", builtin_nth);
+    lenv_add_builtin(e, "last", builtin_last);
+    lenv_add_builtin(e, "take", builtin_take);
+    lenv_add_builtin(e, "drop", builtin_drop);
+    lenv_add_builtin(e, "elem", builtin_elem);
+    lenv_add_builtin(e, "map", builtin_map);
+    lenv_add_builtin(e, "filter", builtin_filter);
+    lenv_add_builtin(e, "foldl", builtin_foldl);
+
+    // Vector functions
+    lenv_add_builtin(e, "vec", builtin_vec);
+    lenv_add_builtin(e, "vget", builtin_vget);
+    lenv_add_builtin(e, "vset", builtin_vset);
+    lenv_add_builtin(e, "vlen", builtin_vlen);
+    lenv_add_builtin(e, "vpush", builtin_vpush);
+    lenv_add_builtin(e, "vslice", builtin_vslice);
+
+    // Map functions
+    lenv_add_builtin(e, "hash-map", builtin_hash_map);
+    lenv_add_builtin(e, "get", builtin_get);
+    lenv_add_builtin(e, "assoc", builtin_assoc);
+    lenv_add_builtin(e, "dissoc", builtin_dissoc);
+    lenv_add_builtin(e, "keys", builtin_keys);
+    lenv_add_builtin(e, "vals", builtin_vals);
 
     // Math functions
     lenv_add_builtin(e, "+", builtin_add);
@@ -1482,6 +7271,9 @@ void lenv_add_builtins(lenv *e)
     // Conditional
     lenv_add_builtin(e, "if", builtin_if);
 
+    // Sequencing
+    lenv_add_builtin(e, "do", builtin_do);
+
     // Comparision functions
     lenv_add_builtin(e, "==", builtin_eq);
     lenv_add_builtin(e, "!=", builtin_ne);
@@ -1492,8 +7284,14 @@ void lenv_add_builtins(lenv *e)
 
     // File loading
     lenv_add_builtin(e, "load", builtin_load);
+    lenv_add_builtin(e, "serialize", builtin_serialize);
+    lenv_add_builtin(e, "deserialize", builtin_deserialize);
 
     // Reporting
     lenv_add_builtin(e, "print", builtin_print);
+    lenv_add_builtin(e, "to-string", builtin_to_string);
     lenv_add_builtin(e, "error", builtin_error);
+
+    // Memory
+    lenv_add_builtin(e, "gc-stats", builtin_gc_stats);
 }
\ No newline at end of file